@@ -1,22 +1,168 @@
+#define _GNU_SOURCE /* for copy_file_range and fopencookie */
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h> /* for malloc/free */
 #include <stdio.h> /* for fs_perror */
 #include <errno.h> /* for fs_perror */
+#include <limits.h>
+#include <sys/stat.h> /* for fs_import_fd */
 #include "apfs.h"
+#if USE_COPY_FILE_RANGE
+#include <sys/sendfile.h>
+#endif
+#if USE_PTHREADS
+#include <pthread.h>
+#endif
+#if USE_SIMD
+#include <immintrin.h>
+#endif
 
 #define divup(a,b) (((a) + (b) - 1) / (b))
 
+#define FS_VERSION	2
+#define FS_JOURNAL_SIG	0x4c4e524a
+/* size of a version 2 directory record, padded to 4 bytes */
+#define recsize(namelen) ((sizeof(FSDirRecord) + (namelen) + 3) & ~3)
+
 int fs_errno;
 
 struct {
-    int fd;
+    int fd, version;
     block_t blocksize, maxblocks, freeblocks, freeblock;
+    block_t hwm; /* the blocks from here on are free, see fat_extend */
+    block_t reserved; /* free blocks promised to delayed writes */
     block_t *cachedfat;
     int cachedfat_block, cachedfat_modified;
+    FSFile *files;
+    int searches; /* directory searches in progress */
+    block_t journal; /* blocks in the journal, 0 if there's none */
+    block_t orphans; /* chains waiting to be freed */
+    block_t orphanblocks; /* in those chains, see FSOrphanLink */
+    char *journal_buf;
+    int journal_max, journal_freed;
+    FSStats stats;
+    unsigned short lastid; /* of the last opened file */
+    char **mcache; /* copies of metadata blocks, see preload_metadata */
+    long mcache_used;
+    int blockshift; /* log2 of blocksize, 0 if it isn't a power of two */
+    int direntries; /* version 1 directory entries in a block */
 } FSState;
 
+/* Byte counts and offsets are split into blocks with a shift and a mask
+   when the block size is a power of two, as it is on the filesystems of
+   create_fs, and with a division for other sizes, such as 65535 */
+#define blk_div(x)	(FSState.blockshift ? (x) >> FSState.blockshift : (x) / FSState.blocksize)
+#define blk_mod(x)	(FSState.blockshift ? (x) & (FSState.blocksize - 1) : (x) % FSState.blocksize)
+#define blk_divup(x)	blk_div((x) + FSState.blocksize - 1)
+
+/* the FAT block holding the entry of a block, and its index there */
+#define fat_block(block)	blk_div(((block) + 8) * (int)sizeof(block_t))
+#define fat_index(block)	(blk_mod(((block) + 8) * (int)sizeof(block_t)) / (int)sizeof(block_t))
+
+static void set_blocksize (block_t blocksize) {
+    FSState.blocksize = blocksize;
+    FSState.direntries = blocksize / sizeof(FSDirEntry);
+    for (FSState.blockshift = 0; 1 << FSState.blockshift < blocksize; FSState.blockshift++)
+	;
+    if (1 << FSState.blockshift != blocksize)
+	FSState.blockshift = 0;
+}
+
+static short int rootdir () {
+    return blk_divup(FSState.maxblocks * 2 + 16);    
+}
+
+/* Latency recording. trace_op starts timing the calling function, which
+   ends when it returns, through the cleanup of the variable it declares.
+   Calls made by other fs_* functions aren't counted on their own. */
+#if APFS_TRACE
+#include <time.h>
+
+typedef struct {
+    int op;
+    char *path;
+    int *bytes;
+    struct timespec start;
+    char *path2;
+    int handle, offset, count;
+} FSTraceScope;
+
+static FSHistogram latency[FSOP_COUNT];
+static FSTraceFunc tracefn;
+static int trace_depth;
+static FILE *tracefile;
+static struct timespec trace_epoch;
+
+static int hist_bucket (unsigned long long v) {
+    int e = 0;
+    if (v < FS_HIST_SUB)
+	return v;
+    while (v >> e >= 2 * FS_HIST_SUB)
+	e++;
+    e = (e + 1) * FS_HIST_SUB + (v >> e) - FS_HIST_SUB;
+    return e < FS_HIST_BUCKETS ? e : FS_HIST_BUCKETS - 1;
+}
+
+#define timespec_ns(a, b) \
+    (((a).tv_sec - (b).tv_sec) * 1000000000ULL + (a).tv_nsec - (b).tv_nsec)
+
+static void trace_write (FSTraceScope *t, unsigned long long ns) {
+    FSTraceRecord r;
+    memset(&r, 0, sizeof(r));
+    r.start = timespec_ns(t->start, trace_epoch);
+    r.ns = ns < 0xffffffffULL ? ns : 0xffffffff;
+    r.offset = t->offset;
+    r.count = t->count;
+    r.result = fs_errno ? -1 : t->bytes ? *t->bytes : 0;
+    r.op = t->op;
+    r.handle = t->handle;
+    r.pathlen = t->path ? strlen(t->path) : 0;
+    r.path2len = t->path2 ? strlen(t->path2) : 0;
+    fwrite(&r, sizeof(r), 1, tracefile);
+    fwrite(t->path, 1, r.pathlen, tracefile);
+    fwrite(t->path2, 1, r.path2len, tracefile);
+}
+
+static FSTraceScope trace_begin (int op, char *path, int *bytes) {
+    FSTraceScope t = {op, path, bytes};
+    if (!trace_depth++)
+	clock_gettime(CLOCK_MONOTONIC, &t.start);
+    return t;
+}
+
+static void trace_end (FSTraceScope *t) {
+    struct timespec now;
+    unsigned long long ns;
+    FSHistogram *h = &latency[t->op];
+    if (--trace_depth)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = timespec_ns(now, t->start);
+    h->count++;
+    h->total += ns;
+    if (ns > h->max)
+	h->max = ns;
+    h->buckets[hist_bucket(ns)]++;
+    if (tracefile)
+	trace_write(t, ns);
+    if (tracefn)
+	tracefn(t->op, t->path, t->bytes ? *t->bytes : 0, ns);
+}
+
+#define trace_op(op, path, bytes) \
+    FSTraceScope trace_scope __attribute__((cleanup(trace_end))) = trace_begin(op, path, bytes)
+/* more arguments of the call, for fs_record */
+#define trace_file(f)	(trace_scope.handle = (f)->id, trace_scope.offset = fs_tell(f))
+#define trace_count(n)	(trace_scope.count = (n))
+#define trace_path2(p)	(trace_scope.path2 = (p))
+#else
+#define trace_op(op, path, bytes)
+#define trace_file(f)
+#define trace_count(n)
+#define trace_path2(p)
+#endif /* APFS_TRACE */
+
 /* Internal functions */
 #define check_os_error(expression) \
     if ((expression) < 0) {	\
@@ -24,66 +170,401 @@ struct {
 	return;			\
     }
 
-static void read_block (block_t blockid, void *addr) {
+/* Block buffers. The calls take the blocks they work on from a pool of
+   buffers kept by each thread, rather than from arrays on the stack, which
+   may be 64KB each, and so do directory searches and the partly written
+   blocks of handles. Buffers too small for the filesystem opened since are
+   given back to malloc when they come up. */
+typedef union FSBuffer {
+    struct {
+	union FSBuffer *next;
+	int size;
+    } hdr;
+    char align[64];	/* the data follows, on a cache line of its own */
+} FSBuffer;
+
+static __thread FSBuffer *buffers;
+
+static char *block_get () {
+    FSBuffer *b;
+    while ((b = buffers) && b->hdr.size < FSState.blocksize) {
+	buffers = b->hdr.next;
+	free(b);
+    }
+    if (b)
+	buffers = b->hdr.next;
+    else if (posix_memalign((void**)&b, sizeof(FSBuffer), sizeof(FSBuffer) + FSState.blocksize))
+	return NULL;
+    else
+	b->hdr.size = FSState.blocksize;
+    return (char*)(b + 1);
+}
+
+static void block_put (void *p) {
+    FSBuffer *b;
+    if (!p)
+	return;
+    b = (FSBuffer*)p - 1;
+    b->hdr.next = buffers;
+    buffers = b;
+}
+
+static void scratch_put (void *p) {
+    block_put(*(void**)p);
+}
+
+/* a block buffer, which goes back to the pool when it goes out of scope */
+#define scratch_block(type, name) \
+    type *name __attribute__((cleanup(scratch_put))) = (type*)block_get()
+
+#define check_scratch(p)	\
+    if (!(p)) {			\
+	fs_errno = FS_ENOMEM;	\
+	return;			\
+    }
+
+#define check_scratch_ret(p, ret) \
+    if (!(p)) {			\
+	fs_errno = FS_ENOMEM;	\
+	return ret;		\
+    }
+
+static void scratch_free (void *p) {
+    free(*(void**)p);
+}
+
+/* buffer of the copies between files and descriptors, on the heap rather
+   than on the stack, which may be a small one of a thread */
+#define COPY_BUFSIZE 65536
+#define scratch_copy(name) \
+    char *name __attribute__((cleanup(scratch_free))) = (char*)malloc(COPY_BUFSIZE)
+
+/* Closed handles, which fs_open reuses. They are allocated APFS_FILE_SLAB
+   at a time, and are never given back. */
+static FSFile *file_pool;
+
+static FSFile *file_get () {
+    FSFile *f;
+    int i;
+    if (!file_pool) {
+	f = (FSFile*)malloc(APFS_FILE_SLAB * sizeof(FSFile));
+	if (!f)
+	    return NULL;
+	for (i = 0; i < APFS_FILE_SLAB; i++) {
+	    f[i].next = file_pool;
+	    file_pool = f + i;
+	}
+    }
+    f = file_pool;
+    file_pool = f->next;
+    return f;
+}
+
+static void file_put (FSFile *f) {
+    f->next = file_pool;
+    file_pool = f;
+}
+
+/* Copies of metadata blocks made at mount by preload_metadata serve
+   read_block until the filesystem is closed. Every write to the image
+   updates the copies of the blocks it covers, whatever they hold by then. */
+static void mcache_write (block_t blockid, int count, char *addr) {
+    int i;
+    if (!FSState.mcache)
+	return;
+    for (i = 0; i < count; i++)
+	if (FSState.mcache[blockid + i])
+	    memcpy(FSState.mcache[blockid + i], addr + i * FSState.blocksize, FSState.blocksize);
+}
+
+/* for the writes which don't go through write_disk_block */
+static void mcache_drop (block_t blockid, int count) {
+    int i;
+    if (!FSState.mcache)
+	return;
+    for (i = 0; i < count && blockid + i < FSState.maxblocks; i++)
+	if (FSState.mcache[blockid + i]) {
+	    free(FSState.mcache[blockid + i]);
+	    FSState.mcache[blockid + i] = NULL;
+	    FSState.mcache_used -= FSState.blocksize;
+	}
+}
+
+static void mcache_free () {
+    int i;
+    if (!FSState.mcache)
+	return;
+    for (i = 0; i < FSState.maxblocks; i++)
+	free(FSState.mcache[i]);
+    free(FSState.mcache);
+    FSState.mcache = NULL;
+    FSState.mcache_used = 0;
+}
+
+/* file data goes straight to the disk, bypassing the journal */
+static void read_disk_block (block_t blockid, void *addr) {
     if (blockid >= FSState.maxblocks) {
 	fs_errno = FS_ENOBLOCK;
 	return;
     }
     check_os_error(lseek(FSState.fd, blockid * FSState.blocksize, SEEK_SET));
     check_os_error(read(FSState.fd, addr, FSState.blocksize));
+    FSState.stats.reads++;
+    FSState.stats.bytesread += FSState.blocksize;
 }
 
-static void write_block (block_t blockid, void *addr) {
+static void write_disk_block (block_t blockid, void *addr) {
     if (blockid >= FSState.maxblocks) {
 	fs_errno = FS_ENOBLOCK;
 	return;
     }
     check_os_error(lseek(FSState.fd, blockid * FSState.blocksize, SEEK_SET));
     check_os_error(write(FSState.fd, addr, FSState.blocksize));
+    mcache_write(blockid, 1, addr);
+    FSState.stats.writes++;
+    FSState.stats.byteswritten += FSState.blocksize;
+}
+
+/* reads or writes count consecutive blocks with a single system call */
+static void read_disk_blocks (block_t blockid, int count, void *addr) {
+    if (blockid + count > FSState.maxblocks) {
+	fs_errno = FS_ENOBLOCK;
+	return;
+    }
+    check_os_error(pread(FSState.fd, addr, (size_t)count * FSState.blocksize,
+			 (off_t)blockid * FSState.blocksize));
+    FSState.stats.reads += count;
+    FSState.stats.bytesread += (size_t)count * FSState.blocksize;
+}
+
+static void write_disk_blocks (block_t blockid, int count, void *addr) {
+    if (blockid + count > FSState.maxblocks) {
+	fs_errno = FS_ENOBLOCK;
+	return;
+    }
+    check_os_error(pwrite(FSState.fd, addr, (size_t)count * FSState.blocksize,
+			  (off_t)blockid * FSState.blocksize));
+    mcache_write(blockid, count, addr);
+    FSState.stats.writes += count;
+    FSState.stats.byteswritten += (size_t)count * FSState.blocksize;
+}
+
+/* The journal buffer holds the header block of the next transaction,
+   followed by the logged blocks, in the very same layout they have in the
+   journal, so a commit is a single write. */
+#define journal_header() ((FSJournalHeader*)FSState.journal_buf)
+#define journal_blocks(hdr) ((block_t*)((FSJournalHeader*)(hdr) + 1))
+#define journal_data(i) (FSState.journal_buf + ((i) + 1) * FSState.blocksize)
+
+static char *journal_find (block_t blockid) {
+    FSJournalHeader *hdr = journal_header();
+    block_t *blocks = journal_blocks(hdr);
+    int i;
+    for (i = 0; i < hdr->count; i++)
+	if (blocks[i] == blockid)
+	    return journal_data(i);
+    return NULL;
+}
+
+static unsigned int journal_sum (char *buf, int count) {
+    unsigned int *p = (unsigned int*)buf, sum = 0;
+    int i;
+    for (i = (count + 1) * FSState.blocksize / sizeof(int); i; i--)
+	sum = (sum << 5) + (sum >> 27) + *p++;
+    return sum;
+}
+
+/* Writes the logged blocks to the journal, and then to their home locations.
+   The data written so far is synced first, so committed metadata never
+   points to blocks which haven't reached the disk. */
+static void journal_commit () {
+    FSJournalHeader *hdr = journal_header();
+    block_t *blocks = journal_blocks(hdr);
+    int i;
+    if (!FSState.journal || !hdr->count)
+	return;
+    hdr->sig = FS_JOURNAL_SIG;
+    hdr->sum = 0;
+    hdr->sum = journal_sum(FSState.journal_buf, hdr->count);
+    check_os_error(fsync(FSState.fd));
+    check_os_error(lseek(FSState.fd, (rootdir() + 1) * FSState.blocksize, SEEK_SET));
+    check_os_error(write(FSState.fd, FSState.journal_buf, (hdr->count + 1) * FSState.blocksize));
+    check_os_error(fsync(FSState.fd));
+    FSState.stats.commits++;
+    FSState.stats.commitblocks += hdr->count;
+    FSState.stats.writes += hdr->count + 1;
+    FSState.stats.byteswritten += (hdr->count + 1) * FSState.blocksize;
+    for (i = 0; i < hdr->count; i++) {
+	write_disk_block(blocks[i], journal_data(i));
+	if (fs_errno)
+	    return;
+    }
+    hdr->count = 0;
+    FSState.journal_freed = 0;
+}
+
+/* Marks the journal empty, once the blocks in it are known to be home */
+static void journal_clear () {
+    scratch_block(char, buf);
+    check_scratch(buf);
+    memset(buf, 0, FSState.blocksize);
+    write_disk_block(rootdir() + 1, buf);
+}
+
+/* Replays the last committed transaction, if it's intact */
+static void journal_replay () {
+    FSJournalHeader *hdr = journal_header();
+    block_t *blocks = journal_blocks(hdr);
+    unsigned int sum;
+    int i;
+    read_disk_block(rootdir() + 1, FSState.journal_buf);
+    if (fs_errno || hdr->sig != FS_JOURNAL_SIG) {
+	hdr->count = 0;
+	return;
+    }
+    if (hdr->count <= FSState.journal_max) {
+	check_os_error(lseek(FSState.fd, (rootdir() + 2) * FSState.blocksize, SEEK_SET));
+	check_os_error(read(FSState.fd, journal_data(0), hdr->count * FSState.blocksize));
+	sum = hdr->sum;
+	hdr->sum = 0;
+	if (journal_sum(FSState.journal_buf, hdr->count) == sum)
+	    for (i = 0; i < hdr->count; i++) {
+		write_disk_block(blocks[i], journal_data(i));
+		if (fs_errno)
+		    return;
+	    }
+	check_os_error(fsync(FSState.fd));
+    }
+    hdr->count = 0;
+    journal_clear();
+}
+
+/* metadata blocks are read and written through the journal */
+static void read_block (block_t blockid, void *addr) {
+    char *data = FSState.journal ? journal_find(blockid) : NULL;
+    if (data) {
+	memcpy(addr, data, FSState.blocksize);
+	FSState.stats.journalhits++;
+    } else if (FSState.mcache && blockid < FSState.maxblocks && FSState.mcache[blockid]) {
+	memcpy(addr, FSState.mcache[blockid], FSState.blocksize);
+	FSState.stats.preloadhits++;
+    } else
+	read_disk_block(blockid, addr);
+}
+
+static void write_block (block_t blockid, void *addr) {
+    FSJournalHeader *hdr = journal_header();
+    char *data;
+    if (!FSState.journal || blockid >= FSState.maxblocks) {
+	write_disk_block(blockid, addr);
+	return;
+    }
+    data = journal_find(blockid);
+    if (!data) {
+	if (hdr->count == FSState.journal_max) {
+	    journal_commit();
+	    if (fs_errno)
+		return;
+	}
+	journal_blocks(hdr)[hdr->count] = blockid;
+	data = journal_data(hdr->count++);
+    }
+    memcpy(data, addr, FSState.blocksize);
 }
 
 static void zero_block (block_t blockid) {
-    char buf[FSState.blocksize];
-    memset(buf, 0, sizeof(buf));
+    scratch_block(char, buf);
+    check_scratch(buf);
+    memset(buf, 0, FSState.blocksize);
+    write_block(blockid, buf);
+}
+
+/* FNV-1a, folded to 16 bits */
+static unsigned short name_hash (char *name, int len) {
+    unsigned int hash = 2166136261u;
+    while (len--)
+	hash = (hash ^ (unsigned char)*name++) * 16777619;
+    return (hash >> 16) ^ (hash & 0xffff);
+}
+
+static void init_dir_block (block_t blockid) {
+    scratch_block(char, buf);
+    FSDirRecord *hdr = (FSDirRecord*)buf;
+    check_scratch(buf);
+    memset(buf, 0, FSState.blocksize);
+    if (FSState.version >= 2) {
+	hdr->attrs = FATTR_HEADER;
+	hdr->reclen = sizeof(FSDirRecord);
+    }
     write_block(blockid, buf);
 }
 
 static void fat_load_block (block_t block) {
     if (block != FSState.cachedfat_block) {
-	if (FSState.cachedfat_modified)
+	FSState.stats.fatmisses++;
+	if (FSState.cachedfat_modified) {
 	    write_block(FSState.cachedfat_block, FSState.cachedfat);
+	    FSState.stats.fatwritebacks++;
+	}
 	read_block(block, FSState.cachedfat);
 	if (fs_errno)
 	    return;
 	FSState.cachedfat_block = block;
 	FSState.cachedfat_modified = 0;
-    }
+    } else
+	FSState.stats.fathits++;
 }
 
 static void flush_fat_cache () {
-    if (FSState.cachedfat_modified)
+    if (FSState.cachedfat_modified) {
         write_block(FSState.cachedfat_block, FSState.cachedfat);
+	FSState.stats.fatwritebacks++;
+    }
     FSState.cachedfat_modified = 0;
 }
 
+static void journal_flush () {
+    flush_fat_cache();
+    if (!fs_errno)
+	journal_commit();
+}
+
+/* Blocks freed by the running transaction can't be reused before it's
+   committed: a crash would bring them back to life, along with whatever
+   got written to them. */
+static void journal_reuse () {
+    if (FSState.journal_freed)
+	journal_flush();
+}
+
+/* Commits between operations, when the transaction gets big, so that a
+   single operation is seldom split between transactions. */
+static void journal_begin () {
+    if (FSState.journal && journal_header()->count >= FSState.journal_max / 2)
+	journal_flush();
+}
+
 static void update_free_space () {
     fat_load_block(0);
     ((FSInfoBlock*)FSState.cachedfat)->freeblocks = FSState.freeblocks;
+    ((FSInfoBlock*)FSState.cachedfat)->orphans = FSState.orphans;
     FSState.cachedfat_modified = 1;
 }
 
 static int read_fatentry (block_t block) {
-    int fblock = (block + 8) / (FSState.blocksize / sizeof(short int));
-    int foffset = (block + 8) % (FSState.blocksize / sizeof(short int));
+    int fblock = fat_block(block);
+    int foffset = fat_index(block);
+    if (block >= FSState.hwm && block < FSState.maxblocks)
+	return block + 1 < FSState.maxblocks ? block + 1 : 0;
     fat_load_block(fblock);
     if (fs_errno)
 	return -1;
     return FSState.cachedfat[foffset];
 }
 
-static void set_fatentry (block_t block, block_t value) {
-    int fblock = (block + 8) / (FSState.blocksize / sizeof(short int));
-    int foffset = (block + 8) % (FSState.blocksize / sizeof(short int));
+static void fat_store (block_t block, block_t value) {
+    int fblock = fat_block(block);
+    int foffset = fat_index(block);
     fat_load_block(fblock);
     if (fs_errno)
 	return;
@@ -91,6 +572,28 @@ static void set_fatentry (block_t block, block_t value) {
     FSState.cachedfat[foffset] = value;
 }
 
+/* Filesystems formatted with APFS_LAZY_FAT leave the FAT entries of their
+   data blocks unwritten. The free blocks from the high-water mark on, kept
+   in the otherwise unused entry of block 1, are the end of the free list,
+   each one followed by the next. Writing an entry past the mark writes
+   the ones before it, and moves the mark over it. */
+static void fat_extend (block_t block) {
+    block_t i = FSState.hwm;
+    FSState.hwm = block + 1;
+    fat_store(1, FSState.hwm < FSState.maxblocks ? FSState.hwm : 0);
+    for (; i < block && !fs_errno; i++)
+	fat_store(i, i + 1);
+}
+
+static void set_fatentry (block_t block, block_t value) {
+    if (block >= FSState.hwm && block < FSState.maxblocks) {
+	fat_extend(block);
+	if (fs_errno)
+	    return;
+    }
+    fat_store(block, value);
+}
+
 #define check_error()	\
     if (fs_errno)	\
 	return;
@@ -99,15 +602,106 @@ static void set_fatentry (block_t block, block_t value) {
     if (fs_errno)	\
 	return ret;
 
+static int dir_compact (block_t dir);
+
+/* Puts the chain from block to tail, count blocks long, in front of the
+   free list */
+static void splice_free (block_t block, block_t tail, int count) {
+    set_fatentry(tail, FSState.freeblock);
+    check_error();
+    set_fatentry(0, block);
+    check_error();
+    FSState.freeblock = block;
+    FSState.freeblocks += count;
+    FSState.journal_freed = 1;
+    update_free_space();
+}
+
+static void free_blocks (block_t block) {
+    block_t listend, tmp;
+    int count = 1;
+    if (!block)
+	return;
+    for (listend = block; (tmp = read_fatentry(listend)); listend = tmp)
+	count++;
+    check_error();
+    splice_free(block, listend, count);
+}
+
+/* A chain whose tail isn't known is freed in constant time by making it an
+   orphan: its first block is pushed on the orphan list, which is linked
+   through the first bytes of the orphans, and is kept in the superblock.
+   The orphans are walked and given back to the free list later, when the
+   free list runs short, or the filesystem is closed. The link goes through
+   the journal, with the change which orphans the chain: until that's
+   committed, the block still holds the file's data. */
+typedef struct {
+    block_t next;	/* the next orphan */
+    block_t blocks;	/* in the chain, as its owner counted them */
+    block_t total;	/* blocks in this chain and the following ones */
+} FSOrphanLink;
+
+/* blocks is what the chain's owner knows of its length, usually from the
+   file size; the free count reported by fs_info adds the total up, and is
+   set right when the chain is walked */
+static void orphan_chain (block_t block, int blocks) {
+    scratch_block(FSOrphanLink, link);
+    check_scratch(link);
+    memset(link, 0, FSState.blocksize);
+    link->next = FSState.orphans;
+    link->blocks = blocks > 0 ? blocks : 1;
+    link->total = FSState.orphanblocks + link->blocks;
+    write_block(block, link);
+    check_error();
+    FSState.orphans = block;
+    FSState.orphanblocks = link->total;
+    update_free_space();
+}
+
+static void reclaim_orphans () {
+    scratch_block(FSOrphanLink, link);
+    block_t block;
+    check_scratch(link);
+    while ((block = FSState.orphans)) {
+	read_block(block, link);
+	check_error();
+	FSState.orphans = link->next;
+	FSState.orphanblocks = link->total - link->blocks;
+	free_blocks(block);
+	check_error();
+    }
+    FSState.orphanblocks = 0;
+}
+
+/* Finds how many blocks the orphans hold, in the link of the first one */
+static void orphans_count () {
+    scratch_block(FSOrphanLink, link);
+    FSState.orphanblocks = 0;
+    if (!FSState.orphans)
+	return;
+    check_scratch(link);
+    read_block(FSState.orphans, link);
+    check_error();
+    FSState.orphanblocks = link->total;
+}
+
 static block_t block_alloc () {
-    block_t newblock = FSState.freeblock;
-    if (!newblock) {
+    block_t newblock;
+    if (!FSState.freeblock || FSState.freeblocks <= FSState.reserved)
+	reclaim_orphans();
+    check_error_ret(0);
+    journal_reuse();
+    check_error_ret(0);
+    newblock = FSState.freeblock;
+    if (!newblock || FSState.freeblocks <= FSState.reserved) {
 	fs_errno = FS_ENOSPACE;
 	return 0;
     }
     FSState.freeblock = read_fatentry(newblock);
     check_error_ret(0);
     FSState.freeblocks--;
+    FSState.stats.allocs++;
+    FSState.stats.allocblocks++;
     set_fatentry(0, FSState.freeblock);
     check_error_ret(0);
     update_free_space();
@@ -116,20 +710,41 @@ static block_t block_alloc () {
     return newblock;
 }
 
-static block_t allocate_blocks (block_t count) {
-    block_t newblock = FSState.freeblock, block = 0;
+static block_t allocate_blocks (block_t count, block_t *tail) {
+    block_t newblock, block;
     int i;
-    for (i = count; i; i--) {
+again:
+    journal_reuse();
+    check_error_ret(0);
+    if (count + FSState.reserved > FSState.freeblocks) {
+	if (FSState.orphans) {
+	    reclaim_orphans();
+	    check_error_ret(0);
+	    goto again;
+	}
+	fs_errno = FS_ENOSPACE;
+	return 0;
+    }
+    newblock = FSState.freeblock;
+    for (i = count, block = 0; i; i--) {
 	block = block ? read_fatentry(block) : newblock;
         check_error_ret(0);
+	if (!block && FSState.orphans) {
+	    reclaim_orphans();
+	    check_error_ret(0);
+	    goto again;
+	}
 	if (!block) {
 	    fs_errno = FS_ENOSPACE;
 	    return 0;
 	}
     }
+    *tail = block;
     FSState.freeblock = read_fatentry(block);
     check_error_ret(0);
     FSState.freeblocks -= count;
+    FSState.stats.allocs++;
+    FSState.stats.allocblocks += count;
     set_fatentry(0, FSState.freeblock);
     check_error_ret(0);
     update_free_space();
@@ -139,23 +754,6 @@ static block_t allocate_blocks (block_t count) {
     return newblock;
 }
 
-static void free_blocks (block_t block) {
-    block_t oldfree = FSState.freeblock;
-    block_t listend, tmp;
-    if (!block)
-	return;
-    for (listend = block; (tmp = read_fatentry(listend)); listend = tmp)
-	FSState.freeblocks++;
-    FSState.freeblocks++;
-    update_free_space();
-    check_error();
-    set_fatentry(0, block);
-    check_error();
-    set_fatentry(listend, oldfree);
-    check_error();
-    FSState.freeblock = block;
-}
-
 static block_t read_alloc_fatentry (block_t block, int zero) {
     int nextblock = read_fatentry(block);
     check_error_ret(0);
@@ -175,8 +773,9 @@ static FSLocation find_dir_space (block_t dir, int length) {
     block_t block = dir;
     FSLocation start;
     int readentries = 0, count = 0;
-    FSDirEntry entries[FSState.blocksize / sizeof(FSDirEntry)];
-    read_block(block, &entries);
+    scratch_block(FSDirEntry, entries);
+    check_scratch_ret(entries, ((FSLocation){0, 0}));
+    read_block(block, entries);
     check_error_ret(((FSLocation){0, 0}));
     while (1) {
 	if (entries[readentries].attrs & FATTR_DELETED) {
@@ -188,117 +787,840 @@ static FSLocation find_dir_space (block_t dir, int length) {
 	    return count ? start : (FSLocation){block, readentries};
 	} else
 	    count = 0;
-	if (++readentries == FSState.blocksize / sizeof(FSDirEntry)) {
+	if (++readentries == FSState.direntries) {
 	    block = read_alloc_fatentry(block, 1);
 	    check_error_ret(((FSLocation){0, 0}));
-	    read_block(block, &entries);
+	    read_block(block, entries);
 	    check_error_ret(((FSLocation){0, 0}));
 	    readentries = 0;
 	}
     }
 }
 
-static void dir_free_ent (FSLocation ent) {
-    int notfirst = 0, blockmod = 0;
-    FSDirEntry entries[FSState.blocksize / sizeof(FSDirEntry)];
-    read_block(ent.block, &entries);
-    check_error();
-    while ((entries[ent.offset].attrs & FATTR_NAMECHUNK) ||
-	    (entries[ent.offset].attrs & FATTR_LASTCHUNK) ||
-	    !notfirst++) {
-	blockmod++;
-	entries[ent.offset].attrs |= FATTR_DELETED;
-	if (++ent.offset == FSState.blocksize / sizeof(FSDirEntry)) {
-	    write_block(ent.block, &entries);
-	    check_error();
-	    ent.block = read_fatentry(ent.block);
-	    if (!ent.block)
-		return;
-	    read_block(ent.block, &entries);
-	    check_error();
-	    ent.offset = 0;
-	    blockmod = 0;
-	}
+/* Directory index */
+#define index_capacity() ((FSState.blocksize - sizeof(FSIndexNode)) / sizeof(FSIndexEntry))
+#define index_entries(node) ((FSIndexEntry*)((FSIndexNode*)(node) + 1))
+
+/* position of the first entry not below hash (above, if after is set) */
+static int index_find (FSIndexNode *node, unsigned short hash, int after) {
+    FSIndexEntry *ent = index_entries(node);
+    int lo = 0, hi = node->count, mid;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (ent[mid].hash < hash || (after && ent[mid].hash == hash))
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
-    if (blockmod)
-	write_block(ent.block, &entries);
+    return lo;
 }
 
-static int process_dir_entry (FSDirEntry *entry, FSFileInfo *result, FSDirSearchInfo *dsinfo, FSLocation dirent) {
-    if (!entry && !result) { /* Initialize the DirSearchInfo structure */
-	dsinfo->nameptr = 0;
-	return 1;
+/* descends to the leftmost leaf which may hold hash, and loads it to buf */
+static block_t index_leaf (block_t node, unsigned short hash, char *buf) {
+    int pos;
+    read_block(node, buf);
+    check_error_ret(0);
+    while (((FSIndexNode*)buf)->level) {
+	pos = index_find((FSIndexNode*)buf, hash, 0);
+	node = index_entries(buf)[pos ? pos - 1 : 0].block;
+	read_block(node, buf);
+	check_error_ret(0);
     }
-    if (entry->attrs == 0)
-	return -1; /* end of directory marker */
-    if ((entry->attrs & FATTR_FILE) ||
-	(entry->attrs & FATTR_DIRECTORY)) {
-	dsinfo->nameptr = 0;
-	result->attrs = entry->attrs;
-	if (entry->attrs & FATTR_DELETED)
+    return node;
+}
+
+/* Inserts ent into the subtree at node. If the node had to be split, the
+   new (right) node is returned, and *split is set to its first hash. */
+static block_t index_insert_node (block_t node, FSIndexEntry ent, unsigned short *split) {
+    scratch_block(char, buf);
+    scratch_block(char, rbuf);
+    FSIndexNode *n = (FSIndexNode*)buf, *r = (FSIndexNode*)rbuf;
+    FSIndexEntry *e = index_entries(buf);
+    block_t right;
+    int pos, half;
+    check_scratch_ret(buf, 0);
+    check_scratch_ret(rbuf, 0);
+    read_block(node, buf);
+    check_error_ret(0);
+    if (n->level) {
+	pos = index_find(n, ent.hash, 0);
+	pos = pos ? pos - 1 : 0;
+	right = index_insert_node(e[pos].block, ent, &ent.hash);
+	if (!right)
 	    return 0;
-	result->size = entry->size;
-	result->firstblk = entry->firstblk;
-	result->dirent = dirent;
-	return entry->chunkcount ? 0 : 1;
-    }
-    if (entry->attrs & FATTR_DELETED)
-	return 0;
-    if (entry->attrs & FATTR_NAMECHUNK) {
-	strncpy(&dsinfo->name[dsinfo->nameptr], (char*)&entry->chunkcount, 7);
-	if (dsinfo->nameptr < sizeof(dsinfo->name) - 7)
-	    dsinfo->nameptr += 7;
-	return 0;
-    }
-    if (entry->attrs & FATTR_LASTCHUNK) {
-	strncpy(&dsinfo->name[dsinfo->nameptr], &entry->chunkcount, 7);
-	dsinfo->name[dsinfo->nameptr + 7] = NULL;
-	result->fname = dsinfo->name;
-	return (result->attrs & FATTR_DELETED) ? 0 : 1;
+	ent.block = right;
+	pos++;
+    } else
+	pos = index_find(n, ent.hash, 1);
+    if (n->count >= index_capacity()) {
+	right = block_alloc();
+	check_error_ret(0);
+	half = (n->count + 1) / 2;
+	memset(rbuf, 0, FSState.blocksize);
+	r->level = n->level;
+	r->count = n->count - half;
+	memcpy(index_entries(r), &e[half], r->count * sizeof(FSIndexEntry));
+	n->count = half;
+	if (!n->level) {
+	    r->next = n->next;
+	    n->next = right;
+	}
+	if (pos > half) {
+	    n = r;
+	    pos -= half;
+	}
+    } else
+	right = 0;
+    e = index_entries(n);
+    memmove(&e[pos + 1], &e[pos], (n->count - pos) * sizeof(FSIndexEntry));
+    e[pos] = ent;
+    n->count++;
+    if (right) {
+	write_block(right, rbuf);
+	check_error_ret(0);
+	*split = index_entries(rbuf)[0].hash;
     }
-    return 0;
+    write_block(node, buf);
+    check_error_ret(0);
+    return right;
 }
 
-static short int rootdir () {
-    return divup(FSState.maxblocks * 2 + 16, FSState.blocksize);    
+static void index_insert (block_t *root, unsigned short hash, block_t block) {
+    scratch_block(char, buf);
+    FSIndexNode *n = (FSIndexNode*)buf;
+    unsigned short split, level;
+    block_t right, newroot;
+    check_scratch(buf);
+    right = index_insert_node(*root, (FSIndexEntry){hash, block}, &split);
+    if (!right)
+	return;
+    read_block(*root, buf);
+    check_error();
+    newroot = block_alloc();
+    check_error();
+    level = n->level + 1;
+    memset(buf, 0, FSState.blocksize);
+    n->level = level;
+    n->count = 2;
+    index_entries(n)[0] = (FSIndexEntry){0, *root};
+    index_entries(n)[1] = (FSIndexEntry){split, right};
+    write_block(newroot, buf);
+    check_error();
+    *root = newroot;
 }
 
-static FSFileInfo *find_dir_entry (unsigned short int block, char *entry) {
-    FSDirEntry blockdata[FSState.blocksize / sizeof(FSDirEntry)];
-    FSDirSearchInfo dsinfo;
-    static FSFileInfo result;
-    int readentries = 0;
-    if (!entry)
+/* Nodes are never merged; an emptied leaf stays in the chain of leaves. */
+static void index_remove (block_t root, unsigned short hash, block_t block) {
+    scratch_block(char, buf);
+    FSIndexNode *n = (FSIndexNode*)buf;
+    FSIndexEntry *e = index_entries(buf);
+    block_t node;
+    int pos;
+    check_scratch(buf);
+    node = index_leaf(root, hash, buf);
+    check_error();
+    pos = index_find(n, hash, 0);
+    while (1) {
+	for (; pos < n->count && e[pos].hash == hash; pos++)
+	    if (e[pos].block == block) {
+		memmove(&e[pos], &e[pos + 1], (n->count - pos - 1) * sizeof(FSIndexEntry));
+		n->count--;
+		write_block(node, buf);
+		return;
+	    }
+	if (pos < n->count || !n->next)
+	    return;
+	node = n->next;
+	read_block(node, buf);
+	check_error();
+	pos = 0;
+    }
+}
+
+static void index_free (block_t node) {
+    scratch_block(char, buf);
+    FSIndexNode *n = (FSIndexNode*)buf;
+    int i;
+    check_scratch(buf);
+    read_block(node, buf);
+    check_error();
+    for (i = 0; n->level && i < n->count; i++) {
+	index_free(index_entries(n)[i].block);
+	check_error();
+    }
+    free_blocks(node);
+}
+
+static int index_cmp (const void *a, const void *b) {
+    return ((FSIndexEntry*)a)->hash - ((FSIndexEntry*)b)->hash;
+}
+
+/* Indexes all of the records of a directory. The tree is built bottom up,
+   leaving a quarter of every node free for later insertions. */
+static void dir_build_index (block_t dir) {
+    scratch_block(char, blockdata);
+    FSIndexNode *n = (FSIndexNode*)blockdata;
+    FSIndexEntry *ents = NULL, *up, *tmp;
+    FSDirRecord *rec;
+    int count = 0, size = 0, per = index_capacity() * 3 / 4, nodes, level, i, offset;
+    block_t block = dir, tail = dir;
+    check_scratch(blockdata);
+    if (per < 2)
+	per = 2;
+    while (block) {
+	read_block(block, blockdata);
+	if (fs_errno)
+	    goto out;
+	for (offset = 0; offset + sizeof(FSDirRecord) <= FSState.blocksize; offset += rec->reclen) {
+	    rec = (FSDirRecord*)&blockdata[offset];
+	    if (!rec->attrs || !rec->reclen)
+		break;
+	    if (rec->attrs & (FATTR_DELETED | FATTR_HEADER))
+		continue;
+	    if (count == size) {
+		size = size ? size * 2 : 256;
+		tmp = (FSIndexEntry*)realloc(ents, size * sizeof(FSIndexEntry));
+		if (!tmp) {
+		    fs_errno = FS_ENOMEM;
+		    goto out;
+		}
+		ents = tmp;
+	    }
+	    ents[count++] = (FSIndexEntry){rec->hash, block};
+	}
+	tail = block;
+	block = read_fatentry(block);
+	if (fs_errno)
+	    goto out;
+    }
+    qsort(ents, count, sizeof(FSIndexEntry), index_cmp);
+    for (level = 0; ; level++) {
+	nodes = count ? divup(count, per) : 1;
+	up = (FSIndexEntry*)malloc(nodes * sizeof(FSIndexEntry));
+	if (!up) {
+	    fs_errno = FS_ENOMEM;
+	    goto out;
+	}
+	for (i = 0; i < nodes; i++) {
+	    up[i].hash = count ? ents[i * per].hash : 0;
+	    up[i].block = block_alloc();
+	    if (fs_errno) {
+		free(up);
+		goto out;
+	    }
+	}
+	for (i = 0; i < nodes; i++) {
+	    memset(blockdata, 0, FSState.blocksize);
+	    n->level = level;
+	    n->count = i < nodes - 1 ? per : count - i * per;
+	    n->next = !level && i < nodes - 1 ? up[i + 1].block : 0;
+	    memcpy(index_entries(n), &ents[i * per], n->count * sizeof(FSIndexEntry));
+	    write_block(up[i].block, blockdata);
+	    if (fs_errno) {
+		free(up);
+		goto out;
+	    }
+	}
+	free(ents);
+	ents = up;
+	count = nodes;
+	if (nodes == 1)
+	    break;
+    }
+    read_block(dir, blockdata);
+    if (fs_errno)
+	goto out;
+    rec = (FSDirRecord*)blockdata;
+    rec->firstblk = ents[0].block;
+    rec->size = tail;
+    write_block(dir, blockdata);
+out:
+    free(ents);
+}
+
+static FSDirRecord *block_find_record (char *blockdata, char *name, int len, unsigned short hash, FSDirSearchInfo *dsinfo) {
+    FSDirRecord *rec;
+    int offset;
+    for (offset = 0; offset + sizeof(FSDirRecord) <= FSState.blocksize; offset += rec->reclen) {
+	rec = (FSDirRecord*)&blockdata[offset];
+	if (!rec->attrs || !rec->reclen)
+	    break;
+	if (rec->attrs & FATTR_DELETED)
+	    dsinfo->deleted++;
+	else if (!(rec->attrs & FATTR_HEADER))
+	    dsinfo->live++;
+	if (rec->hash == hash && rec->namelen == len &&
+	    !(rec->attrs & (FATTR_DELETED | FATTR_HEADER)) &&
+	    !memcmp(rec + 1, name, len))
+	    return rec;
+    }
+    return NULL;
+}
+
+/* the index root of a directory, given its first block */
+#define dir_index(blockdata) \
+    ((((FSDirRecord*)(blockdata))->attrs & FATTR_HEADER) ? ((FSDirRecord*)(blockdata))->firstblk : 0)
+
+/* compacts dir, if a scan through all of it found it mostly deleted */
+static void dir_check_deleted (block_t dir, FSDirSearchInfo *dsinfo) {
+    int err = fs_errno;
+    if (dsinfo->blocks > 1 && !FSState.searches &&
+	dsinfo->deleted * 100 > (dsinfo->live + dsinfo->deleted) * APFS_COMPACT_RATIO) {
+	dir_compact(dir);
+	fs_errno = err;
+    }
+}
+
+static void dir_free_record (block_t dir, FSLocation ent) {
+    scratch_block(char, blockdata);
+    FSDirRecord *rec = (FSDirRecord*)&blockdata[ent.offset];
+    unsigned short hash;
+    check_scratch(blockdata);
+    read_block(ent.block, blockdata);
+    check_error();
+    rec->attrs |= FATTR_DELETED;
+    hash = rec->hash;
+    write_block(ent.block, blockdata);
+    check_error();
+    if (!dir)
+	return;
+    read_block(dir, blockdata);
+    check_error();
+    if (dir_index(blockdata))
+	index_remove(dir_index(blockdata), hash, ent.block);
+}
+
+static void dir_free_ent (block_t dir, FSLocation ent) {
+    int notfirst = 0, blockmod = 0;
+    scratch_block(FSDirEntry, entries);
+    check_scratch(entries);
+    if (FSState.version >= 2) {
+	dir_free_record(dir, ent);
+	return;
+    }
+    read_block(ent.block, entries);
+    check_error();
+    while ((entries[ent.offset].attrs & FATTR_NAMECHUNK) ||
+	    (entries[ent.offset].attrs & FATTR_LASTCHUNK) ||
+	    !notfirst++) {
+	blockmod++;
+	entries[ent.offset].attrs |= FATTR_DELETED;
+	if (++ent.offset == FSState.direntries) {
+	    write_block(ent.block, entries);
+	    check_error();
+	    ent.block = read_fatentry(ent.block);
+	    if (!ent.block)
+		return;
+	    read_block(ent.block, entries);
+	    check_error();
+	    ent.offset = 0;
+	    blockmod = 0;
+	}
+    }
+    if (blockmod)
+	write_block(ent.block, entries);
+}
+
+static int process_dir_entry (FSDirEntry *entry, FSFileInfo *result, FSDirSearchInfo *dsinfo, FSLocation dirent) {
+    if (!entry && !result) { /* Initialize the DirSearchInfo structure */
+	dsinfo->nameptr = 0;
+	dsinfo->live = dsinfo->deleted = 0;
+	dsinfo->blocks = 1;
+	return 1;
+    }
+    if (entry->attrs == 0)
+	return -1; /* end of directory marker */
+    if ((entry->attrs & FATTR_FILE) ||
+	(entry->attrs & FATTR_DIRECTORY)) {
+	dsinfo->nameptr = 0;
+	result->attrs = entry->attrs;
+	if (entry->attrs & FATTR_DELETED) {
+	    dsinfo->deleted++;
+	    return 0;
+	}
+	dsinfo->live++;
+	result->size = entry->size;
+	result->firstblk = entry->firstblk;
+	result->dirent = dirent;
+	return entry->chunkcount ? 0 : 1;
+    }
+    if (entry->attrs & FATTR_DELETED)
+	return 0;
+    if (entry->attrs & FATTR_NAMECHUNK) {
+	strncpy(&dsinfo->name[dsinfo->nameptr], (char*)&entry->chunkcount, 7);
+	if (dsinfo->nameptr < sizeof(dsinfo->name) - 7)
+	    dsinfo->nameptr += 7;
+	return 0;
+    }
+    if (entry->attrs & FATTR_LASTCHUNK) {
+	strncpy(&dsinfo->name[dsinfo->nameptr], &entry->chunkcount, 7);
+	dsinfo->name[dsinfo->nameptr + 7] = NULL;
+	result->fname = dsinfo->name;
+	return (result->attrs & FATTR_DELETED) ? 0 : 1;
+    }
+    return 0;
+}
+
+/* Version 1 directory blocks are scanned a window of up to 64 entries at a
+   time. dir_classify sorts the entries of a window by their attrs, one bit
+   per entry, and finds the ones whose name bytes are those of key, the
+   first name chunk of the entry looked up, as strncpy would have put them
+   there. It uses SSE2, or AVX2 where the processor has it. */
+typedef struct {
+    unsigned long long end;	/* end of directory markers */
+    unsigned long long live, dead; /* entries of files and directories */
+    unsigned long long chunk;	/* plain name chunks */
+    unsigned long long match;	/* the name bytes are those of the key */
+} FSDirScan;
+
+#define low_bits(n) ((n) < 64 ? (1ULL << (n)) - 1 : ~0ULL)
+
+static void dir_classify_scalar (FSDirEntry *e, int count, char *key, FSDirScan *s) {
+    unsigned long long bit;
+    unsigned char attrs;
+    char *name;
+    int i, k;
+    memset(s, 0, sizeof(FSDirScan));
+    for (i = 0, bit = 1; i < count; i++, bit <<= 1) {
+	attrs = e[i].attrs;
+	if (!attrs)
+	    s->end |= bit;
+	else if (attrs & (FATTR_FILE | FATTR_DIRECTORY))
+	    *(attrs & FATTR_DELETED ? &s->dead : &s->live) |= bit;
+	else if (attrs == FATTR_NAMECHUNK || attrs == FATTR_LASTCHUNK)
+	    s->chunk |= bit;
+	name = &e[i].chunkcount;
+	for (k = 0; k < 7 && name[k] == key[k + 1] && name[k]; k++)
+	    ;
+	if (k == 7 || name[k] == key[k + 1])
+	    s->match |= bit;
+    }
+}
+
+#if USE_SIMD
+static void dir_scan_add (FSDirScan *s, FSDirScan *g, int at) {
+    s->end |= g->end << at;
+    s->live |= g->live << at;
+    s->dead |= g->dead << at;
+    s->chunk |= g->chunk << at;
+    s->match |= g->match << at;
+}
+
+/* the bytes of the key which decide a match: the name up to its NUL, and
+   the NUL */
+static long long dir_key_mask (char *key) {
+    char mask[8] = {0};
+    long long m;
+    int i;
+    for (i = 1; i < 8; i++) {
+	mask[i] = 0xff;
+	if (!key[i])
+	    break;
+    }
+    memcpy(&m, mask, 8);
+    return m;
+}
+
+/* The entries are 8 bytes, one to a 64-bit lane, with attrs in the low
+   byte. A lane matches the key when the bytes kept by the mask are equal,
+   which _mm_sad_epu8 finds out by adding up their xor. */
+#define lane_attrs(x) _mm_and_si128(x, _mm_set1_epi64x(0xff))
+#define lane_diff(x) _mm_sad_epu8(_mm_and_si128(_mm_xor_si128(x, k), km), _mm_setzero_si128())
+
+static void dir_classify_sse2 (FSDirEntry *e, int count, char *key, FSDirScan *s) {
+    __m128i zero = _mm_setzero_si128(), k, km, x[8], a[4], d[4], attrs, match;
+    unsigned int head, dead;
+    long long kv, mask;
+    FSDirScan g;
+    int i, j;
+    memcpy(&kv, key, 8);
+    mask = dir_key_mask(key);
+    k = _mm_set1_epi64x(kv);
+    km = _mm_set1_epi64x(mask);
+    memset(s, 0, sizeof(FSDirScan));
+    for (i = 0; i + 16 <= count; i += 16) {
+	for (j = 0; j < 8; j++)
+	    x[j] = _mm_loadu_si128((__m128i*)(e + i) + j);
+	/* saturating packs bring the low bytes of the 16 lanes together */
+	for (j = 0; j < 4; j++) {
+	    a[j] = _mm_packs_epi32(lane_attrs(x[2 * j]), lane_attrs(x[2 * j + 1]));
+	    d[j] = _mm_packs_epi32(lane_diff(x[2 * j]), lane_diff(x[2 * j + 1]));
+	}
+	attrs = _mm_packus_epi16(_mm_packs_epi32(a[0], a[1]), _mm_packs_epi32(a[2], a[3]));
+	match = _mm_packus_epi16(_mm_packs_epi32(d[0], d[1]), _mm_packs_epi32(d[2], d[3]));
+	head = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(attrs,
+	    _mm_set1_epi8(FATTR_FILE | FATTR_DIRECTORY)), zero)) & 0xffff;
+	dead = _mm_movemask_epi8(attrs);	/* FATTR_DELETED is the top bit */
+	g.end = _mm_movemask_epi8(_mm_cmpeq_epi8(attrs, zero));
+	g.live = head & ~dead;
+	g.dead = head & dead;
+	g.chunk = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(attrs, _mm_set1_epi8(FATTR_NAMECHUNK)),
+						 _mm_cmpeq_epi8(attrs, _mm_set1_epi8(FATTR_LASTCHUNK))));
+	g.match = _mm_movemask_epi8(_mm_cmpeq_epi8(match, zero));
+	dir_scan_add(s, &g, i);
+    }
+    if (i < count) {
+	dir_classify_scalar(e + i, count - i, key, &g);
+	dir_scan_add(s, &g, i);
+    }
+}
+
+/* The same, 32 entries at a time. The packs work within the 128-bit
+   halves, and leave pairs of entries out of order, which avx2_order puts
+   back. */
+#define lane_attrs256(x) _mm256_and_si256(x, _mm256_set1_epi64x(0xff))
+#define lane_diff256(x) _mm256_sad_epu8(_mm256_and_si256(_mm256_xor_si256(x, k), km), _mm256_setzero_si256())
+
+__attribute__((target("avx2")))
+static __m256i avx2_order (__m256i p) {
+    p = _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_shuffle_epi8(p, _mm256_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+						   0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15));
+}
+
+__attribute__((target("avx2")))
+static void dir_classify_avx2 (FSDirEntry *e, int count, char *key, FSDirScan *s) {
+    __m256i zero = _mm256_setzero_si256(), k, km, x[8], a[4], d[4], attrs, match;
+    unsigned int head, dead;
+    long long kv, mask;
+    FSDirScan g;
+    int i, j;
+    memcpy(&kv, key, 8);
+    mask = dir_key_mask(key);
+    k = _mm256_set1_epi64x(kv);
+    km = _mm256_set1_epi64x(mask);
+    memset(s, 0, sizeof(FSDirScan));
+    for (i = 0; i + 32 <= count; i += 32) {
+	for (j = 0; j < 8; j++)
+	    x[j] = _mm256_loadu_si256((__m256i*)(e + i) + j);
+	for (j = 0; j < 4; j++) {
+	    a[j] = _mm256_packs_epi32(lane_attrs256(x[2 * j]), lane_attrs256(x[2 * j + 1]));
+	    d[j] = _mm256_packs_epi32(lane_diff256(x[2 * j]), lane_diff256(x[2 * j + 1]));
+	}
+	attrs = avx2_order(_mm256_packus_epi16(_mm256_packs_epi32(a[0], a[1]), _mm256_packs_epi32(a[2], a[3])));
+	match = avx2_order(_mm256_packus_epi16(_mm256_packs_epi32(d[0], d[1]), _mm256_packs_epi32(d[2], d[3])));
+	head = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(attrs,
+	    _mm256_set1_epi8(FATTR_FILE | FATTR_DIRECTORY)), zero));
+	dead = _mm256_movemask_epi8(attrs);
+	g.end = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(attrs, zero));
+	g.live = head & ~dead;
+	g.dead = head & dead;
+	g.chunk = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+	    _mm256_cmpeq_epi8(attrs, _mm256_set1_epi8(FATTR_NAMECHUNK)),
+	    _mm256_cmpeq_epi8(attrs, _mm256_set1_epi8(FATTR_LASTCHUNK))));
+	g.match = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(match, zero));
+	dir_scan_add(s, &g, i);
+    }
+    _mm256_zeroupper();	/* the SSE code after it would pay for the upper halves */
+    if (i < count) {
+	dir_classify_sse2(e + i, count - i, key, &g);
+	dir_scan_add(s, &g, i);
+    }
+}
+#endif /* USE_SIMD */
+
+static void dir_classify_pick (FSDirEntry *e, int count, char *key, FSDirScan *s);
+
+static void (*dir_classify)(FSDirEntry *, int, char *, FSDirScan *) = dir_classify_pick;
+
+/* the first call chooses the scanner for the processor */
+static void dir_classify_pick (FSDirEntry *e, int count, char *key, FSDirScan *s) {
+#if USE_SIMD
+    __builtin_cpu_init();
+    dir_classify = __builtin_cpu_supports("avx2") ? dir_classify_avx2 : dir_classify_sse2;
+#else
+    dir_classify = dir_classify_scalar;
+#endif
+    dir_classify(e, count, key, s);
+}
+
+#define dead_entry(e) (((e).attrs & FATTR_DELETED) && ((e).attrs & (FATTR_FILE | FATTR_DIRECTORY)))
+
+/* Passes over a run of deleted entries of a search, up to the next live
+   entry or the end of the directory, within a window, with the effect
+   process_dir_entry has on them. Returns how many it passed, or 0 for a
+   lone deleted entry, which is quicker to go through one at a time. */
+static int dir_skip_deleted (FSDirSearchInfo *dsinfo, FSFileInfo *result) {
+    FSDirEntry *e = dsinfo->cache + dsinfo->dirent.offset;
+    int count = FSState.direntries - dsinfo->dirent.offset, n;
+    char key[8] = {0};
+    FSDirScan s;
+    n = (unsigned char)e->chunkcount + 1;
+    if (n >= count || !dead_entry(e[n]))
+	return 0;
+    if (count > 64)
+	count = 64;
+    dir_classify(e, count, key, &s);
+    n = s.live | s.end ? __builtin_ctzll(s.live | s.end) : count;
+    dsinfo->deleted += __builtin_popcountll(s.dead & low_bits(n));
+    dsinfo->nameptr = 0;
+    result->attrs = e->attrs;
+    return n;
+}
+
+static void record_file_info (FSDirRecord *rec, FSFileInfo *result, char *name, block_t dir, FSLocation dirent) {
+    memcpy(name, rec + 1, rec->namelen);
+    name[rec->namelen] = 0;
+    result->attrs = rec->attrs;
+    result->fname = name;
+    result->size = rec->size;
+    result->firstblk = rec->firstblk;
+    result->dir = dir;
+    result->dirent = dirent;
+}
+
+static void dir_entries_init (FSDirSearchInfo *dsinfo, FSFileInfo *fi) {
+    process_dir_entry(NULL, NULL, dsinfo, (FSLocation){0, 0});
+    dsinfo->name[0] = 0;
+    fi->fname = dsinfo->name;
+}
+
+/* Calls fn for each live entry of blockdata, a block of the directory dir
+   read without the search functions. dsinfo and fi, set up by
+   dir_entries_init, carry names across the blocks of version 1
+   directories; name holds those of version 2. Returns -1 at the end of a
+   version 1 directory. */
+static int dir_entries (char *blockdata, block_t block, block_t dir, FSDirSearchInfo *dsinfo,
+			FSFileInfo *fi, char *name, void (*fn)(FSFileInfo *, void *), void *arg) {
+    FSDirRecord *rec;
+    int i, offset;
+    if (FSState.version < 2) {
+	for (i = 0; i < FSState.direntries; i++)
+	    switch (process_dir_entry((FSDirEntry*)blockdata + i, fi, dsinfo, (FSLocation){block, i})) {
+		case -1:
+		    return -1;
+		case 1:
+		    fn(fi, arg);
+	    }
+	return 0;
+    }
+    for (offset = 0; offset + sizeof(FSDirRecord) <= FSState.blocksize; offset += rec->reclen) {
+	rec = (FSDirRecord*)(blockdata + offset);
+	if (!rec->attrs || !rec->reclen)
+	    break;
+	if (rec->attrs & (FATTR_DELETED | FATTR_HEADER))
+	    continue;
+	record_file_info(rec, fi, name, dir, (FSLocation){block, offset});
+	fn(fi, arg);
+    }
+    return 0;
+}
+
+static FSFileInfo *find_dir_record (block_t dir, char *entry, FSFileInfo *result) {
+    scratch_block(char, blockdata);
+    scratch_block(char, buf);
+    FSIndexNode *n = (FSIndexNode*)buf;
+    FSIndexEntry *e = index_entries(buf);
+    FSDirSearchInfo dsinfo;
+    static char name[256];
+    int len = strlen(entry), pos;
+    unsigned short hash = name_hash(entry, len);
+    block_t block = dir;
+    FSDirRecord *rec;
+    check_scratch_ret(blockdata, NULL);
+    check_scratch_ret(buf, NULL);
+    FSState.stats.lookups++;
+    FSState.stats.lookupblocks++;
+    read_block(block, blockdata);
+    check_error_ret(NULL);
+    process_dir_entry(NULL, NULL, &dsinfo, (FSLocation){0, 0});
+    if (!dir_index(blockdata)) {
+	while (!(rec = block_find_record(blockdata, entry, len, hash, &dsinfo))) {
+	    block = read_fatentry(block);
+	    if (block == 0) {
+		dir_check_deleted(dir, &dsinfo);
+		return NULL;
+	    }
+	    dsinfo.blocks++;
+	    FSState.stats.lookupblocks++;
+	    read_block(block, blockdata);
+	    check_error_ret(NULL);
+	}
+    } else {
+	index_leaf(dir_index(blockdata), hash, buf);
+	check_error_ret(NULL);
+	pos = index_find(n, hash, 0);
+	while (1) {
+	    if (pos == n->count && n->next) {
+		read_block(n->next, buf);
+		check_error_ret(NULL);
+		pos = 0;
+		continue;
+	    }
+	    if (pos == n->count || e[pos].hash != hash)
+		return NULL;
+	    block = e[pos++].block;
+	    FSState.stats.lookupblocks++;
+	    read_block(block, blockdata);
+	    check_error_ret(NULL);
+	    if ((rec = block_find_record(blockdata, entry, len, hash, &dsinfo)))
+		break;
+	}
+    }
+    record_file_info(rec, result, name, dir, (FSLocation){block, (char*)rec - blockdata});
+    return result;
+}
+
+/* Only the live entries whose first name chunk matches that of the entry
+   looked up, and those whose name isn't all in the window, go through
+   process_dir_entry; the rest of each window is passed over at once. */
+static FSFileInfo *find_dir_entry (unsigned short int block, char *entry) {
+    scratch_block(FSDirEntry, blockdata);
+    static FSDirSearchInfo dsinfo; /* result.fname points into it */
+    static FSFileInfo result;
+    int readentries = 0, count, n, scalar = 0;
+    unsigned long long stop;
+    block_t dir = block;
+    char key[8] = {0};
+    FSDirScan s;
+    check_scratch_ret(blockdata, NULL);
+    if (!entry)
 	return &result;
+    if (FSState.version >= 2)
+	return find_dir_record(block, entry, &result);
+    result.dir = block;
+    FSState.stats.lookups++;
+    FSState.stats.lookupblocks++;
+    strncpy(key + 1, entry, 7);
     process_dir_entry(NULL, NULL, &dsinfo, (FSLocation){0, 0});
-    read_block(block, &blockdata);
+    read_block(block, blockdata);
     check_error_ret(NULL);
     while (1) {
-	switch (process_dir_entry(&blockdata[readentries], &result, &dsinfo, (FSLocation){block, readentries})) {
-	    case -1:
-		return NULL;
-	    case 0:
-		break;
-	    case 1:
-		if (!strcmp(result.fname, entry))
-		    return &result;
+	/* a candidate is followed up to the next entry of a file */
+	if (scalar == 2 && (blockdata[readentries].attrs & (FATTR_FILE | FATTR_DIRECTORY)))
+	    scalar = 0;
+	if (scalar) {
+	    scalar = 2;
+	    switch (process_dir_entry(&blockdata[readentries], &result, &dsinfo, (FSLocation){block, readentries})) {
+		case -1:
+		    dir_check_deleted(dir, &dsinfo);
+		    return NULL;
+		case 1:
+		    if (!strcmp(result.fname, entry))
+			return &result;
+	    }
+	} else {
+	    count = FSState.direntries - readentries;
+	    if (count > 64)
+		count = 64;
+	    dir_classify(blockdata + readentries, count, key, &s);
+	    stop = s.end | (s.live & ((~s.chunk | s.match) >> 1 | 1ULL << (count - 1)));
+	    n = stop ? __builtin_ctzll(stop) : count;
+	    dsinfo.live += __builtin_popcountll(s.live & low_bits(n));
+	    dsinfo.deleted += __builtin_popcountll(s.dead & low_bits(n));
+	    readentries += n;
+	    if (n < count) {
+		scalar = 1;
+		continue;
+	    }
+	    readentries--;
 	}
-	if (++readentries == FSState.blocksize / sizeof(FSDirEntry)) {
+	if (++readentries == FSState.direntries) {
 	    block = read_fatentry(block);
-	    if (block == 0)
+	    if (block == 0) {
+		dir_check_deleted(dir, &dsinfo);
 		return NULL;
-	    read_block(block, &blockdata);
+	    }
+	    dsinfo.blocks++;
+	    FSState.stats.lookupblocks++;
+	    read_block(block, blockdata);
 	    check_error_ret(NULL);
 	    readentries = 0;
 	}
     }
 }
 
+/* Place a record in the first deleted record large enough to hold it,
+   splitting off the remainder, or else in the free space at the end of a
+   block, extending the directory if needed. */
+static void add_dir_record (block_t dir, FSFileInfo *inf) {
+    scratch_block(char, blockdata);
+    int len = inf->fname ? strlen(inf->fname) : 0;
+    int need = recsize(len), offset, reclen, blocks = 0;
+    block_t block = dir, root, tail = 0;
+    unsigned short hash;
+    FSDirRecord *rec;
+    check_scratch(blockdata);
+    if (len > 255 || need > FSState.blocksize) {
+	fs_errno = FS_ENAMETOOLONG;
+	return;
+    }
+    read_block(block, blockdata);
+    check_error();
+    /* indexed directories only grow at their end */
+    if ((root = dir_index(blockdata))) {
+	tail = ((FSDirRecord*)blockdata)->size;
+	if (tail != block) {
+	    block = tail;
+	    read_block(block, blockdata);
+	    check_error();
+	}
+    }
+    while (1) {
+	blocks++;
+	for (offset = 0; offset + sizeof(FSDirRecord) <= FSState.blocksize; offset += rec->reclen) {
+	    rec = (FSDirRecord*)&blockdata[offset];
+	    if (!rec->attrs || !rec->reclen) {
+		if (FSState.blocksize - offset < need)
+		    break;
+		reclen = need;
+		goto found;
+	    }
+	    if ((rec->attrs & FATTR_DELETED) && rec->reclen >= need) {
+		reclen = rec->reclen;
+		if (reclen - need >= sizeof(FSDirRecord)) {
+		    FSDirRecord *rest = (FSDirRecord*)&blockdata[offset + need];
+		    memset(rest, 0, sizeof(FSDirRecord));
+		    rest->attrs = FATTR_DELETED;
+		    rest->reclen = reclen - need;
+		    reclen = need;
+		}
+		goto found;
+	    }
+	}
+	block = read_alloc_fatentry(block, 1);
+	check_error();
+	read_block(block, blockdata);
+	check_error();
+    }
+found:
+    rec->attrs = inf->attrs;
+    rec->namelen = len;
+    rec->reclen = reclen;
+    rec->size = inf->size;
+    rec->firstblk = inf->firstblk;
+    rec->hash = hash = name_hash(inf->fname, len);
+    memcpy(rec + 1, inf->fname, len);
+    inf->dirent = (FSLocation){block, offset};
+    write_block(block, blockdata);
+    check_error();
+    if (root) {
+	block_t oldroot = root;
+	index_insert(&root, hash, block);
+	check_error();
+	if (root != oldroot || block != tail) {
+	    read_block(dir, blockdata);
+	    check_error();
+	    rec = (FSDirRecord*)blockdata;
+	    rec->firstblk = root;
+	    rec->size = block;
+	    write_block(dir, blockdata);
+	}
+    } else if (blocks > APFS_DIRINDEX_BLOCKS)
+	dir_build_index(dir);
+}
+
 static void add_dir_entry (block_t dir, FSFileInfo *inf) {
     int length = 1;
     FSLocation newdirent;
-    FSDirEntry entries[FSState.blocksize / sizeof(FSDirEntry)];
+    scratch_block(FSDirEntry, entries);
     int entrynum = 1;
+    check_scratch(entries);
+    inf->dir = dir;
+    if (FSState.version >= 2) {
+	add_dir_record(dir, inf);
+	return;
+    }
     if (inf->fname)
 	length += divup(strlen(inf->fname), 7);
     if (length > 37) {
@@ -306,7 +1628,7 @@ static void add_dir_entry (block_t dir, FSFileInfo *inf) {
 	return;
     }
     newdirent = find_dir_space(dir, length);
-    read_block(newdirent.block, &entries);
+    read_block(newdirent.block, entries);
     check_error();
     while (1) {
 	if (entrynum == 1) {
@@ -320,22 +1642,22 @@ static void add_dir_entry (block_t dir, FSFileInfo *inf) {
 	        entries[newdirent.offset].attrs = FATTR_LASTCHUNK;
 	    else
 	        entries[newdirent.offset].attrs = FATTR_NAMECHUNK;
-	    strncpy(&entries[newdirent.offset].chunkcount, &inf->fname[(entrynum - 2) * 7], 7);
+	    strncpy((char*)&entries[newdirent.offset] + 1, &inf->fname[(entrynum - 2) * 7], 7);
 	    if (entrynum == length)
 		break;
 	}
 	entrynum++;
-	if (++newdirent.offset == FSState.blocksize / sizeof(FSDirEntry)) {
-	    write_block(newdirent.block, &entries);
+	if (++newdirent.offset == FSState.direntries) {
+	    write_block(newdirent.block, entries);
 	    check_error();
 	    newdirent.block = read_alloc_fatentry(newdirent.block, 1);
 	    check_error();
-	    read_block(newdirent.block, &entries);
+	    read_block(newdirent.block, entries);
 	    check_error();
 	    newdirent.offset = 0;
 	}
     }
-    write_block(newdirent.block, &entries);
+    write_block(newdirent.block, entries);
 }
 
 static FSFileInfo *get_file_info (char *dir) {
@@ -356,6 +1678,7 @@ static FSFileInfo *get_file_info (char *dir) {
 	fi->size = 0;
 	fi->attrs = FATTR_FILE | FATTR_DIRECTORY;
 	fi->firstblk = rootdir();
+	fi->dir = 0;
 	fi->dirent = (FSLocation){0, 0};
 	return fi;
     }
@@ -371,6 +1694,10 @@ static FSFileInfo *get_file_info (char *dir) {
 	    return NULL;
 	}
 	block = fi->firstblk;
+	if (!block) {	/* a directory which never had an entry */
+	    fs_errno = FS_ENOENT;
+	    return NULL;
+	}
     } else {
 	ptr = tmp;
 	block = rootdir();
@@ -383,17 +1710,28 @@ static FSFileInfo *get_file_info (char *dir) {
 }
 
 static void file_update_dirent (FSFileInfo *f) {
-    FSDirEntry entries[FSState.blocksize / sizeof(FSDirEntry)];
-    read_block(f->dirent.block, &entries);
+    scratch_block(FSDirEntry, entries);
+    check_scratch(entries);
+    read_block(f->dirent.block, entries);
     check_error();
-    entries[f->dirent.offset].firstblk = f->firstblk;
-    entries[f->dirent.offset].size = f->size;
-    write_block(f->dirent.block, &entries);
+    if (FSState.version >= 2) {
+	FSDirRecord *rec = (FSDirRecord*)((char*)entries + f->dirent.offset);
+	rec->firstblk = f->firstblk;
+	rec->size = f->size;
+	rec->attrs = (rec->attrs & ~FATTR_SPARSE) | (f->attrs & FATTR_SPARSE);
+    } else {
+	entries[f->dirent.offset].firstblk = f->firstblk;
+	entries[f->dirent.offset].size = f->size;
+	entries[f->dirent.offset].attrs &= ~FATTR_SPARSE;
+	entries[f->dirent.offset].attrs |= f->attrs & FATTR_SPARSE;
+    }
+    write_block(f->dirent.block, entries);
     check_error();
 }
 
 static void set_file_size (FSFile *f, int newsize) {
     FSFileInfo finfo;
+    finfo.attrs = f->sparse ? FATTR_SPARSE : 0;
     finfo.dirent = f->dirent;
     finfo.firstblk = f->first_block;
     finfo.size = newsize;
@@ -404,7 +1742,7 @@ static void set_file_size (FSFile *f, int newsize) {
 static int create_dir_first_entry (FSFileInfo *dir) {
     block_t newblk = block_alloc();
     check_error_ret(0);
-    zero_block(newblk);
+    init_dir_block(newblk);
     check_error_ret(0);
     dir->firstblk = newblk;
     dir->size = FSState.blocksize;
@@ -442,16 +1780,24 @@ static FSFileInfo *create_file (char *pathname, int attrs) {
 static void dir_search_init (FSFileInfo *fi, FSDirSearchInfo *dsinfo) {
     process_dir_entry(NULL, NULL, dsinfo, (FSLocation){0, 0});
     dsinfo->dirent = (FSLocation){fi->firstblk, 0};
-    dsinfo->cache = (FSDirEntry*)malloc(FSState.blocksize);
+    dsinfo->dir = fi->firstblk;
+    dsinfo->cache = (FSDirEntry*)block_get();
     if (!dsinfo->cache) {
 	fs_errno = FS_ENOMEM;
 	return;
     }
     read_block(dsinfo->dirent.block, dsinfo->cache);
     if (fs_errno) {
-	free(dsinfo->cache);
+	block_put(dsinfo->cache);
 	dsinfo->cache = 0;
-    }
+    } else
+	FSState.searches++;
+}
+
+static void dir_search_end (FSDirSearchInfo *dsinfo) {
+    block_put(dsinfo->cache);
+    dsinfo->cache = 0;
+    FSState.searches--;
 }
 
 static void file_perform_seek (FSFile *f) {
@@ -466,6 +1812,8 @@ static void file_perform_seek (FSFile *f) {
 	blk = f->current_block;
 	i = f->fileptr.block;
     }
+    FSState.stats.seeks++;
+    FSState.stats.seekhops += f->seek_block - i;
     for (; i < f->seek_block; i++) {
 	blk = read_fatentry(blk);
 	if (!blk) {
@@ -478,131 +1826,1362 @@ static void file_perform_seek (FSFile *f) {
     f->fileptr.block = f->seek_block;
 }
 
-/* exported functions */
-int format_fs () {
-    int i = 0;
-    fs_errno = FS_NOERR;
-    zero_block(rootdir());
-    check_error_ret(-1);
-    FSState.freeblocks = FSState.maxblocks - rootdir() - 1;
-    FSState.freeblock = rootdir() + 1;
-    set_fatentry(0, FSState.freeblock); 
-    check_error_ret(-1);
-    for (i = 1; i <= rootdir(); i++)
-	set_fatentry(i, 0);		
-    check_error_ret(-1);
-    for (i = rootdir() + 1; i + 1 < FSState.maxblocks; i++)
-	set_fatentry(i, i + 1);
-    check_error_ret(-1);
-    set_fatentry(FSState.maxblocks - 1, 0);
-    check_error_ret(-1);
-    flush_fat_cache();
-    check_error_ret(-1);
-    return 0;
+/* Hints the kernel to start reading count blocks from start */
+static void prefetch_blocks (block_t start, int count) {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(FSState.fd, (off_t)start * FSState.blocksize,
+		  (off_t)count * FSState.blocksize, POSIX_FADV_WILLNEED);
+#endif
 }
 
-int create_fsex (char *fname, block_t blocksize, block_t blockcount) {
-    FSInfoBlock ib;
-    fs_errno = FS_NOERR;
-    ib.sig = 0x53465041;
-    ib.version = 1;
-    ib.blocksize = blocksize;
-    ib.maxblocks = blockcount;
-    FSState.maxblocks = ib.maxblocks;
-    FSState.blocksize = ib.blocksize;
-    ib.freeblocks = ib.maxblocks - rootdir() - 1;
-    memset(ib.reserved, 0, sizeof(ib.reserved));
-    FSState.fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (FSState.fd < 0) {
-	fs_errno = FS_EOS;
-	return -1;
-    }
-    FSState.cachedfat = (short int*)malloc(FSState.blocksize);
-    if (!FSState.cachedfat) {
-	fs_errno = FS_ENOMEM;
-	return -1;
+/* Returns the length of the run of consecutive blocks starting at block,
+   up to max blocks, and the block following the run in *next */
+static int chain_run (block_t block, int max, block_t *next) {
+    int n = 1;
+    block_t nextblk;
+    for (;; n++) {
+	nextblk = read_fatentry(block);
+	check_error_ret(0);
+	if (n == max || nextblk != block + 1)
+	    break;
+	block = nextblk;
     }
-    FSState.cachedfat_block = 0;
-    FSState.cachedfat_modified = 1;
-    read_block(0, FSState.cachedfat);
-    check_error_ret(-1);
-    memcpy(FSState.cachedfat, &ib, sizeof(ib));
-    return format_fs();
+    *next = nextblk;
+    return n;
 }
 
-int create_fs(char *fname, unsigned int size) {
-    int blocksize = 512;
-    while (size / 65535 > blocksize)
-        if (blocksize < 32768)
-	    blocksize <<= 1;
+/* Tells the kernel to read ahead the blocks of a file which is read
+   sequentially, following its chain from where the last readahead got to,
+   up to the window past the end of the coming read of count bytes */
+static void file_readahead (FSFile *f, int count) {
+    block_t start, end, next;
+    int target, last = blk_divup(f->file_size) - 1;
+    if (!APFS_READAHEAD_BLOCKS)
+	return;
+    if (fs_tell(f) != f->ra_pos) {
+	f->ra_window = 0;
+	return;
+    }
+    target = f->fileptr.block + blk_div(count - 1);
+    if (!f->ra_window || f->ra_block < f->fileptr.block) {
+	f->ra_window = f->ra_window ? f->ra_window : 4;
+	f->ra_block = f->fileptr.block;
+	f->ra_phys = f->current_block;
+    } else if (f->ra_block - target > f->ra_window / 2)
+	return;
+    else if (f->ra_window < APFS_READAHEAD_BLOCKS)
+	f->ra_window *= 2;
+    target += f->ra_window;
+    if (target > last)
+	target = last;
+    start = end = 0;
+    while (f->ra_block < target) {
+	next = read_fatentry(f->ra_phys);
+	if (fs_errno || !next)
+	    break;
+	if (start && next != end + 1) {
+	    prefetch_blocks(start, end - start + 1);
+	    start = 0;
+	}
+	if (!start)
+	    start = next;
+	end = next;
+	f->ra_phys = next;
+	f->ra_block++;
+	FSState.stats.readahead++;
+    }
+    if (start)
+	prefetch_blocks(start, end - start + 1);
+    fs_errno = FS_NOERR;
+}
+
+/* Writes the block buffered by a handle to the disk, and forgets it */
+static void file_write_back (FSFile *f) {
+    if (f->wdirty)
+	write_disk_block(f->wblock, f->wbuf);
+    f->wblock = 0;
+    f->wdirty = 0;
+}
+
+/* Writes back the block buffered by any other handle, before f buffers
+   it, so that no two handles hold their own copies of a block */
+static void file_claim_block (FSFile *f, block_t block) {
+    FSFile *h;
+    for (h = FSState.files; h && !fs_errno; h = h->next)
+	if (h != f && h->wblock == block)
+	    file_write_back(h);
+}
+
+/* Drops the buffers of the handles holding one of count blocks from block
+   on, which are about to be written whole */
+static void file_drop_buffers (block_t block, int count) {
+    FSFile *h;
+    for (h = FSState.files; h; h = h->next)
+	if (h->wblock >= block && h->wblock < block + count)
+	    h->wblock = h->wdirty = 0;
+}
+
+/* Delayed allocation: data written past the end of the chain of a file
+   gathers in the handle, from dstart on, and only the free blocks it needs
+   are counted as taken. The blocks are allocated when the handle is
+   flushed, all at once, so a file written in many small calls still gets
+   a single run of blocks. */
+static int file_delayed (FSFile *f) {
+    int pos = fs_tell(f);
+    if (!APFS_DELALLOC_BYTES || f->sparse)
+	return 0;
+    if (f->dlen)
+	return pos >= f->dstart;
+    return blk_mod(pos) == 0 && pos >= blk_divup(f->file_size) * FSState.blocksize;
+}
+
+static void file_allocate (FSFile *f) {
+    int n = blk_divup(f->dlen), keep = blk_div(f->dstart), i, run;
+    block_t first, tail, prev, block, next;
+    FSFile *h;
+    if (!f->dlen)
+	return;
+    /* the chain should end right before dstart, and is cut there if not;
+       data from the start of the file replaces the whole chain */
+    if (!keep)
+	prev = 0;
+    else if (f->blocks == keep)
+	prev = f->last_block;
+    else
+	for (prev = f->first_block, i = 1; prev && i < keep; i++) {
+	    prev = read_fatentry(prev);
+	    check_error();
+	}
+    if (keep && !prev) {
+	fs_errno = FS_ENOBLOCK;
+	return;
+    }
+    next = prev ? read_fatentry(prev) : f->first_block;
+    check_error();
+    FSState.reserved -= n;
+    first = allocate_blocks(n, &tail);
+    if (fs_errno) {
+	FSState.reserved += n;
+	return;
+    }
+    if (next)
+	orphan_chain(next, f->blocks > keep ? f->blocks - keep : 1);
+    check_error();
+    if (prev)
+	set_fatentry(prev, first);
+    else {
+	/* the other handles of the file move to the new chain */
+	for (h = FSState.files; h; h = h->next)
+	    if (h != f && h->dirent.block == f->dirent.block &&
+		h->dirent.offset == f->dirent.offset) {
+		h->first_block = h->current_block = first;
+		h->fileptr.block = 0;
+		h->ra_window = 0;
+		h->wblock = h->wdirty = 0;
+	    }
+	f->first_block = first;
+	set_file_size(f, f->file_size);
+    }
+    check_error();
+    for (i = 0, block = first; i < n; i += run, block = next) {
+	run = chain_run(block, n - i, &next);
+	check_error();
+	write_disk_blocks(block, run, f->dbuf + i * FSState.blocksize);
+	check_error();
+    }
+    for (h = FSState.files; h; h = h->next)
+	if (h->first_block == f->first_block)
+	    h->blocks = -1;
+    f->blocks = keep + n;
+    f->last_block = tail;
+    f->fileptr.block = keep + n - 1;
+    f->current_block = tail;
+    free(f->dbuf);
+    f->dbuf = NULL;
+    f->dlen = f->dsize = 0;
+}
+
+/* Forgets the delayed data of the handles of a file being removed */
+static void file_discard (FSLocation dirent) {
+    FSFile *f;
+    for (f = FSState.files; f; f = f->next)
+	if (f->dlen && f->dirent.block == dirent.block && f->dirent.offset == dirent.offset) {
+	    FSState.reserved -= blk_divup(f->dlen);
+	    free(f->dbuf);
+	    f->dbuf = NULL;
+	    f->dlen = f->dsize = 0;
+	    f->sizedirty = 0;
+	}
+}
+
+/* Takes as much of buf as fits in the handle, allocating the data it has
+   already when it's full */
+static int file_delay (FSFile *f, char *buf, int count) {
+    int pos = fs_tell(f), need, size;
+    char *p;
+    if (!f->dlen)
+	f->dstart = pos;
+    pos -= f->dstart;
+    if (count > APFS_DELALLOC_BYTES - pos)
+	count = APFS_DELALLOC_BYTES - pos;
+    if (count <= 0) {
+	file_allocate(f);
+	return fs_errno ? -1 : 0;
+    }
+    need = blk_divup(pos + count) - blk_divup(f->dlen);
+    if (need > 0 && need + FSState.reserved > FSState.freeblocks) {
+	reclaim_orphans();
+	if (!fs_errno && need + FSState.reserved > FSState.freeblocks)
+	    fs_errno = FS_ENOSPACE;
+	if (fs_errno)
+	    return -1;
+    }
+    if (pos + count > f->dsize) {
+	size = f->dsize ? f->dsize * 2 : 16 * FSState.blocksize;
+	if (size < pos + count)
+	    size = pos + count;
+	size = blk_divup(size) * FSState.blocksize;
+	p = (char*)realloc(f->dbuf, size);
+	if (!p) {
+	    fs_errno = FS_ENOMEM;
+	    return -1;
+	}
+	memset(p + f->dsize, 0, size - f->dsize);
+	f->dbuf = p;
+	f->dsize = size;
+    }
+    memcpy(f->dbuf + pos, buf, count);
+    if (pos + count > f->dlen) {
+	if (need > 0)
+	    FSState.reserved += need;
+	f->dlen = pos + count;
+    }
+    pos += f->dstart + count;
+    f->seek_block = blk_div(pos);
+    f->fileptr.offset = blk_mod(pos);
+    if (pos > f->file_size) {
+	f->file_size = pos;
+	f->sizedirty = 1;
+    }
+    return count;
+}
+
+/* Writes out all a handle holds back: its delayed data, its buffered
+   block, and its size */
+static void file_flush (FSFile *f) {
+    file_allocate(f);
+    check_error();
+    file_write_back(f);
+    check_error();
+    if (f->sizedirty) {
+	f->sizedirty = 0;
+	set_file_size(f, f->file_size);
+    }
+}
+
+/* Writes back the buffered and delayed blocks of all the handles of the
+   file of f, so that they can be read from the disk. Files which have no
+   blocks yet are told apart by their directory entries. */
+static void file_sync_data (FSFile *f) {
+    FSFile *h;
+    for (h = FSState.files; h && !fs_errno; h = h->next)
+	if ((h->wdirty || h->dlen) && h->first_block == f->first_block &&
+	    (f->first_block || (h->dirent.block == f->dirent.block &&
+				h->dirent.offset == f->dirent.offset))) {
+	    file_allocate(h);
+	    if (!fs_errno)
+		file_write_back(h);
+	}
+}
+
+/* Flushes all the open files, before their blocks or directory entries get
+   read or moved by something which doesn't know about the handles */
+static void flush_files () {
+    FSFile *f;
+    for (f = FSState.files; f && !fs_errno; f = f->next)
+	file_flush(f);
+}
+
+/* Finds an open handle of the file starting at first, which knows the tail
+   of its chain for sure */
+static FSFile *file_find_tail (block_t first) {
+    FSFile *f;
+    for (f = FSState.files; f; f = f->next)
+	if (f->first_block == first && f->blocks > 0 &&
+	    read_fatentry(f->last_block) == 0)
+	    return f;
+    return NULL;
+}
+
+/* Counts the blocks of a file without walking its chain: from the size of
+   a dense file, and from the map header of a sparse one */
+static int file_chain_blocks (block_t first, int size, int sparse) {
+    scratch_block(FSSparseHeader, hdr);
+    if (!sparse || !hdr)
+	return blk_divup(size);
+    read_block(first, hdr);
+    return hdr->blocks ? hdr->blocks : blk_divup(size);
+}
+
+/* Frees the chain of a file in constant time: right away if an open handle
+   knows its tail, or else by making it an orphan */
+static void free_file_blocks (block_t first, int size, int sparse) {
+    FSFile *f;
+    int blocks;
+    if (!first)
+	return;
+    f = file_find_tail(first);
+    if (f)
+	splice_free(first, f->last_block, f->blocks);
+    else {
+	blocks = file_chain_blocks(first, size, sparse);
+	check_error();
+	orphan_chain(first, blocks);
+    }
+    check_error();
+    for (f = FSState.files; f; f = f->next)
+	if (f->first_block == first) {
+	    f->blocks = -1;
+	    f->wblock = f->wdirty = f->sizedirty = 0;
+	}
+}
+
+/* Sparse files. Their handles keep the map at the head of the chain in
+   memory, as the list of the blocks the file has, each with the block it
+   is in. The map goes through the journal, so it changes along with the
+   FAT, and it's written back at the end of every call which changed it. */
+typedef struct FSBlockMap {
+    int count, size;		/* blocks in the lists, and room for them */
+    unsigned int *logical;	/* blocks of the file, ascending */
+    block_t *physical;		/* where they are */
+    int runs;			/* runs of consecutive blocks of the file */
+    int mapblocks;		/* blocks the map takes on the disk */
+    block_t maplast;		/* the last of them, which the data follows */
+    char *image;		/* the map as it was last written */
+    int clean;			/* map blocks known to hold their image */
+} FSBlockMap;
+
+#define sparse_mapsize(runs) \
+    blk_divup(sizeof(FSSparseHeader) + (runs) * sizeof(FSSparseRun))
+
+/* blocks of a file are numbered by a block_t, which sets how far it may
+   reach */
+#define file_limit() \
+    ((int)(0xffffLL * FSState.blocksize < INT_MAX ? 0xffffLL * FSState.blocksize : INT_MAX))
+
+static void sparse_drop (FSFile *f) {
+    if (!f->map)
+	return;
+    free(f->map->logical);
+    free(f->map->physical);
+    free(f->map->image);
+    free(f->map);
+    f->map = NULL;
+}
+
+/* Returns where the first block of the map at or past block is */
+static int sparse_find (FSBlockMap *m, unsigned int block) {
+    int lo = 0, hi = m->count, mid;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (m->logical[mid] < block)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static int sparse_grow (FSBlockMap *m, int count) {
+    unsigned int *logical;
+    block_t *physical;
+    int size = m->size ? m->size : 16;
+    if (count <= m->size)
+	return 0;
+    while (size < count)
+	size *= 2;
+    logical = (unsigned int*)realloc(m->logical, size * sizeof(unsigned int));
+    if (logical)
+	m->logical = logical;
+    physical = (block_t*)realloc(m->physical, size * sizeof(block_t));
+    if (physical)
+	m->physical = physical;
+    if (!logical || !physical) {
+	fs_errno = FS_ENOMEM;
+	return -1;
+    }
+    m->size = size;
+    return 0;
+}
+
+static int sparse_runs (FSBlockMap *m) {
+    int i, runs = 0;
+    for (i = 0; i < m->count; i++)
+	if (!i || m->logical[i] != m->logical[i - 1] + 1)
+	    runs++;
+    return runs;
+}
+
+/* Reads the map of a sparse file, unless the handle has it already */
+static FSBlockMap *sparse_load (FSFile *f) {
+    FSBlockMap *m;
+    FSSparseHeader *hdr;
+    FSSparseRun *run;
+    block_t block = f->first_block;
+    char *image;
+    int i, j, total = 0;
+    if (f->map)
+	return f->map;
+    m = f->map = (FSBlockMap*)calloc(1, sizeof(FSBlockMap));
+    if (!m || !(m->image = (char*)malloc(FSState.blocksize))) {
+	fs_errno = FS_ENOMEM;
+	goto fail;
+    }
+    read_block(block, m->image);
+    if (fs_errno)
+	goto fail;
+    hdr = (FSSparseHeader*)m->image;
+    if (hdr->runs > FSState.maxblocks) {
+	fs_errno = FS_EFORMAT;
+	goto fail;
+    }
+    m->runs = hdr->runs;
+    m->mapblocks = m->clean = sparse_mapsize(m->runs);
+    image = (char*)realloc(m->image, m->mapblocks * FSState.blocksize);
+    if (!image) {
+	fs_errno = FS_ENOMEM;
+	goto fail;
+    }
+    m->image = image;
+    for (i = 1; i < m->mapblocks; i++) {
+	block = read_fatentry(block);
+	if (!fs_errno && !block)
+	    fs_errno = FS_EFORMAT;
+	if (fs_errno)
+	    goto fail;
+	read_block(block, m->image + i * FSState.blocksize);
+	if (fs_errno)
+	    goto fail;
+    }
+    m->maplast = block;
+    run = (FSSparseRun*)((FSSparseHeader*)m->image + 1);
+    for (i = 0; i < m->runs; i++)
+	total += run[i].count;
+    if (sparse_grow(m, total))
+	goto fail;
+    for (i = 0; i < m->runs; i++)
+	for (j = 0; j < run[i].count; j++) {
+	    block = read_fatentry(block);
+	    if (!fs_errno && !block)
+		fs_errno = FS_EFORMAT;
+	    if (fs_errno)
+		goto fail;
+	    m->logical[m->count] = run[i].start + j;
+	    m->physical[m->count++] = block;
+	}
+    return m;
+fail:
+    sparse_drop(f);
+    return NULL;
+}
+
+/* Makes the map of a sparse file n blocks long, adding blocks to its end,
+   or giving back the ones past n */
+static void sparse_resize (FSFile *f, int n) {
+    FSBlockMap *m = f->map;
+    block_t next, first, tail, block;
+    int i;
+    next = read_fatentry(m->maplast);
+    check_error();
+    if (n > m->mapblocks) {
+	first = allocate_blocks(n - m->mapblocks, &tail);
+	check_error();
+	set_fatentry(tail, next);
+	check_error();
+	set_fatentry(m->maplast, first);
+	check_error();
+	m->maplast = tail;
+    } else if (n < m->mapblocks) {
+	for (i = 1, block = f->first_block; i < n && !fs_errno; i++)
+	    block = read_fatentry(block);
+	first = read_fatentry(block);
+	check_error();
+	set_fatentry(m->maplast, 0);
+	check_error();
+	set_fatentry(block, next);
+	check_error();
+	free_blocks(first);
+	check_error();
+	m->maplast = block;
+	if (m->clean > n)
+	    m->clean = n;
+    }
+    m->mapblocks = n;
+}
+
+/* Writes the map of a sparse file back after its blocks changed, only the
+   map blocks which differ from what they hold. The other handles of the
+   file read it again when they need it. */
+static void sparse_store (FSFile *f) {
+    FSBlockMap *m = f->map;
+    FSSparseRun *run;
+    FSFile *h;
+    block_t block;
+    char *image;
+    int i, n = sparse_mapsize(m->runs), bs = FSState.blocksize;
+    for (h = FSState.files; h; h = h->next)
+	if (h->first_block == f->first_block) {
+	    h->blocks = -1;
+	    if (h != f)
+		sparse_drop(h);
+	}
+    if (n != m->mapblocks) {
+	sparse_resize(f, n);
+	check_error();
+    }
+    image = (char*)calloc(n, bs);
+    if (!image) {
+	fs_errno = FS_ENOMEM;
+	return;
+    }
+    ((FSSparseHeader*)image)->runs = m->runs;
+    ((FSSparseHeader*)image)->blocks = n + m->count;
+    run = (FSSparseRun*)((FSSparseHeader*)image + 1) - 1;
+    for (i = 0; i < m->count; i++)
+	if (i && m->logical[i] == m->logical[i - 1] + 1)
+	    run->count++;
+	else {
+	    run++;
+	    run->start = m->logical[i];
+	    run->count = 1;
+	}
+    for (i = 0, block = f->first_block; i < n && !fs_errno; i++) {
+	if (i >= m->clean || memcmp(image + i * bs, m->image + i * bs, bs))
+	    write_block(block, image + i * bs);
+	if (!fs_errno && i < n - 1)
+	    block = read_fatentry(block);
+    }
+    if (fs_errno) {
+	free(image);
+	return;
+    }
+    free(m->image);
+    m->image = image;
+    m->clean = n;
+}
+
+/* Makes a file sparse, before a hole gets into it: the blocks it has
+   become the first run of its map */
+static void sparse_convert (FSFile *f) {
+    FSBlockMap *m;
+    FSFile *h;
+    block_t block, prev = 0, first, tail;
+    int count = blk_divup(f->file_size);
+    for (h = FSState.files; h && !fs_errno; h = h->next)
+	if (h->dirent.block == f->dirent.block && h->dirent.offset == f->dirent.offset)
+	    file_flush(h);
+    check_error();
+    m = (FSBlockMap*)calloc(1, sizeof(FSBlockMap));
+    if (!m) {
+	fs_errno = FS_ENOMEM;
+	return;
+    }
+    for (block = f->first_block; block && m->count < count; block = read_fatentry(block)) {
+	if (fs_errno || sparse_grow(m, m->count + 1))
+	    goto fail;
+	m->logical[m->count] = m->count;
+	m->physical[m->count++] = prev = block;
+    }
+    if (fs_errno)
+	goto fail;
+    first = allocate_blocks(1, &tail);
+    if (fs_errno)
+	goto fail;
+    set_fatentry(first, m->count ? f->first_block : 0);
+    if (!fs_errno && block) {
+	/* the blocks past the size, which a truncate may leave */
+	if (prev)
+	    set_fatentry(prev, 0);
+	if (!fs_errno)
+	    orphan_chain(block, 1);
+    }
+    if (fs_errno)
+	goto fail;
+    m->runs = sparse_runs(m);
+    m->mapblocks = 1;
+    m->maplast = first;
+    for (h = FSState.files; h; h = h->next)
+	if (h->dirent.block == f->dirent.block && h->dirent.offset == f->dirent.offset) {
+	    h->first_block = first;
+	    h->sparse = 1;
+	}
+    f->map = m;
+    sparse_store(f);
+    check_error();
+    set_file_size(f, f->file_size);
+    return;
+fail:
+    free(m->logical);
+    free(m->physical);
+    free(m);
+}
+
+/* Gives a block to the hole at block of a sparse file, whose place in the
+   map is k, and links it in the chain after the block before it */
+static block_t sparse_insert (FSFile *f, int k, unsigned int block) {
+    FSBlockMap *m = f->map;
+    int runs = m->runs + 1;
+    block_t phys, prev;
+    int next;
+    if (k > 0 && m->logical[k - 1] == block - 1)
+	runs--;
+    if (k < m->count && m->logical[k] == block + 1)
+	runs--;
+    /* the map grows first, so the chain never has blocks it doesn't list */
+    if (sparse_mapsize(runs) > m->mapblocks) {
+	sparse_resize(f, sparse_mapsize(runs));
+	check_error_ret(0);
+    }
+    if (sparse_grow(m, m->count + 1))
+	return 0;
+    phys = block_alloc();
+    check_error_ret(0);
+    prev = k ? m->physical[k - 1] : m->maplast;
+    next = read_fatentry(prev);
+    check_error_ret(0);
+    set_fatentry(phys, next);
+    check_error_ret(0);
+    set_fatentry(prev, phys);
+    check_error_ret(0);
+    memmove(m->logical + k + 1, m->logical + k, (m->count - k) * sizeof(unsigned int));
+    memmove(m->physical + k + 1, m->physical + k, (m->count - k) * sizeof(block_t));
+    m->logical[k] = block;
+    m->physical[k] = phys;
+    m->count++;
+    m->runs = runs;
+    return phys;
+}
+
+static int sparse_read (FSFile *f, char *buf, int count) {
+    FSBlockMap *m = sparse_load(f);
+    scratch_block(char, blockdata);
+    int bs = FSState.blocksize, pos = fs_tell(f), done = 0, k, n, run;
+    unsigned int block;
+    check_scratch_ret(blockdata, -1);
+    check_error_ret(-1);
+    if (count > f->file_size - pos)
+	count = f->file_size - pos;
+    k = sparse_find(m, blk_div(pos));
+    while (done < count) {
+	block = blk_div(pos);
+	n = count - done;
+	if (k == m->count || m->logical[k] > block) {
+	    /* a hole, up to the next block the file has */
+	    if (k < m->count && (long long)m->logical[k] * bs - pos < n)
+		n = m->logical[k] * bs - pos;
+	    memset(buf + done, 0, n);
+	} else if (blk_mod(pos) || n < bs) {
+	    if (n > bs - blk_mod(pos))
+		n = bs - blk_mod(pos);
+	    read_disk_block(m->physical[k], blockdata);
+	    if (fs_errno)
+		break;
+	    memcpy(buf + done, blockdata + blk_mod(pos), n);
+	    k++;
+	} else {
+	    /* whole blocks, consecutive in the file and on the disk */
+	    for (run = 1; run < blk_div(n) && k + run < m->count &&
+		 m->logical[k + run] == block + run &&
+		 m->physical[k + run] == m->physical[k] + run; run++)
+		;
+	    read_disk_blocks(m->physical[k], run, buf + done);
+	    if (fs_errno)
+		break;
+	    n = run * bs;
+	    k += run;
+	}
+	done += n;
+	pos += n;
+    }
+    f->seek_block = blk_div(pos);
+    f->fileptr.offset = blk_mod(pos);
+    return done;
+}
+
+/* Writes to a sparse file, a block at a time. Holes written to get blocks
+   of their own, except for zeros, which leave them holes. */
+static int sparse_write (FSFile *f, char *buf, int count) {
+    FSBlockMap *m = sparse_load(f);
+    scratch_block(char, blockdata);
+    int bs = FSState.blocksize, pos = fs_tell(f), done = 0, changed = 0, k, n, err;
+    block_t phys;
+    check_scratch_ret(blockdata, -1);
+    check_error_ret(-1);
+    if (count > file_limit() - pos)
+	count = file_limit() - pos;
+    if (count <= 0) {
+	fs_errno = FS_ENOSPACE;
+	return -1;
+    }
+    while (done < count) {
+	n = count - done < bs - blk_mod(pos) ? count - done : bs - blk_mod(pos);
+	k = sparse_find(m, blk_div(pos));
+	if (k < m->count && m->logical[k] == blk_div(pos)) {
+	    phys = m->physical[k];
+	    if (n < bs)
+		read_disk_block(phys, blockdata);
+	} else if (!buf[done] && !memcmp(buf + done, buf + done + 1, n - 1))
+	    phys = 0;
+	else {
+	    phys = sparse_insert(f, k, blk_div(pos));
+	    changed = 1;
+	    memset(blockdata, 0, bs);
+	}
+	if (fs_errno)
+	    break;
+	if (phys && n < bs) {
+	    memcpy(blockdata + blk_mod(pos), buf + done, n);
+	    write_disk_block(phys, blockdata);
+	} else if (phys)
+	    write_disk_block(phys, buf + done);
+	if (fs_errno)
+	    break;
+	done += n;
+	pos += n;
+    }
+    /* the map has to follow the chain, even if the write failed midway */
+    if (changed) {
+	err = fs_errno;
+	fs_errno = FS_NOERR;
+	sparse_store(f);
+	if (err)
+	    fs_errno = err;
+    }
+    f->seek_block = blk_div(pos);
+    f->fileptr.offset = blk_mod(pos);
+    if (pos > f->file_size) {
+	f->file_size = pos;
+	f->sizedirty = 1;
+    }
+    return done;
+}
+
+/* Cuts a sparse file at size, giving back the blocks past it */
+static void sparse_truncate (FSFile *f, int size) {
+    FSBlockMap *m = sparse_load(f);
+    block_t prev;
+    int k;
+    check_error();
+    k = sparse_find(m, blk_divup(size));
+    if (k < m->count) {
+	prev = k ? m->physical[k - 1] : m->maplast;
+	set_fatentry(prev, 0);
+	check_error();
+	orphan_chain(m->physical[k], m->count - k);
+	check_error();
+	m->count = k;
+	m->runs = sparse_runs(m);
+	sparse_store(f);
+	check_error();
+    }
+    set_file_size(f, size);
+}
+
+/* Fills the gap between the end of a file and pos, before a write there:
+   with zeros if it ends in the block after the last one, or else with a
+   hole, which makes the file sparse */
+static void file_extend (FSFile *f, int pos) {
+    scratch_block(char, zeros);
+    int size = f->file_size, n;
+    check_scratch(zeros);
+    if (!f->sparse && blk_div(pos) > blk_divup(size)) {
+	sparse_convert(f);
+	check_error();
+    }
+    memset(zeros, 0, FSState.blocksize);
+    fs_seek(f, size);
+    /* the last block may have old data past the end */
+    for (; size < pos; size += n) {
+	n = pos - size < FSState.blocksize ? pos - size : FSState.blocksize;
+	if (f->sparse) {
+	    if (blk_mod(size) == 0)
+		break;
+	    if (n > FSState.blocksize - blk_mod(size))
+		n = FSState.blocksize - blk_mod(size);
+	}
+	if ((f->sparse ? sparse_write(f, zeros, n) : fs_write(f, zeros, n)) != n)
+	    return;
+    }
+    fs_seek(f, pos);
+    if (pos > f->file_size) {
+	f->file_size = pos;
+	f->sizedirty = 1;
+    }
+}
+
+/* Calls fn for every file under the directory path */
+static void tree_files (char *path, void (*fn)(FSFileInfo *, void *), void *arg) {
+    FSDirSearchInfo dsinfo;
+    FSFileInfo *fi;
+    char sub[strlen(path) + 258];
+    for (fi = fs_findfirst(path, &dsinfo); fi; fi = fs_findnext(&dsinfo)) {
+	if (fi->attrs & FATTR_DIRECTORY) {
+	    sprintf(sub, "%s/%s", path, fi->fname);
+	    tree_files(sub, fn, arg);
+	} else
+	    fn(fi, arg);
+	if (fs_errno) {
+	    fs_findend(&dsinfo);
+	    return;
+	}
+    }
+}
+
+static void frag_file (FSFileInfo *fi, void *arg) {
+    FSFragInfo *st = (FSFragInfo*)arg;
+    int block, prev = 0, extents = 0;
+    for (block = fi->firstblk; block; prev = block, block = read_fatentry(block)) {
+	check_error();
+	if (block != prev + 1)
+	    extents++;
+	st->blocks++;
+    }
+    st->files++;
+    st->extents += extents;
+    if (extents > 1)
+	st->fragmented++;
+}
+
+/* Defragmentation works on an in-memory copy of the FAT, with back links
+   for the free list, so blocks can be taken out of the middle of it. */
+typedef struct {
+    block_t *fat, *prev;
+    char *isfree;
+    int moved;
+} FSDefrag;
+
+static void defrag_unlink (FSDefrag *d, block_t block) {
+    block_t prev = d->prev[block], next = d->fat[block];
+    d->fat[prev] = next;
+    set_fatentry(prev, next);
+    check_error();
+    if (!prev)
+	FSState.freeblock = next;
+    if (next)
+	d->prev[next] = prev;
+    d->isfree[block] = 0;
+}
+
+static void defrag_push (FSDefrag *d, block_t block) {
+    block_t head = d->fat[0];
+    d->fat[block] = head;
+    set_fatentry(block, head);
+    check_error();
+    if (head)
+	d->prev[head] = block;
+    d->prev[block] = 0;
+    d->fat[0] = block;
+    set_fatentry(0, block);
+    FSState.freeblock = block;
+    FSState.journal_freed = 1;
+    d->isfree[block] = 1;
+}
+
+/* Moves a fragmented file to the first free run long enough to hold it.
+   The copy is complete before the directory entry points at it, and the
+   old blocks are only freed afterwards. */
+static void defrag_file (FSFileInfo *fi, void *arg) {
+    FSDefrag *d = (FSDefrag*)arg;
+    scratch_block(char, blockdata);
+    block_t block, next = 0, start, old = fi->firstblk;
+    int count = 0, contiguous = 1, run = 0, i;
+    FSFile *f;
+    check_scratch(blockdata);
+    for (block = old; block && count < FSState.maxblocks; block = d->fat[block], count++) {
+	if (count && block != next + 1)
+	    contiguous = 0;
+	next = block;
+    }
+    if (contiguous)
+	return;
+    for (i = rootdir() + 1; i < FSState.maxblocks && run < count; i++)
+	run = d->isfree[i] ? run + 1 : 0;
+    if (run < count)
+	return;
+    start = i - count;
+    journal_reuse();
+    check_error();
+    for (i = 0; i < count; i++) {
+	defrag_unlink(d, start + i);
+	check_error();
+    }
+    for (i = 0, block = old; i < count; i++, block = d->fat[block]) {
+	read_disk_block(block, blockdata);
+	check_error();
+	write_disk_block(start + i, blockdata);
+	check_error();
+	d->fat[start + i] = i < count - 1 ? start + i + 1 : 0;
+	set_fatentry(start + i, d->fat[start + i]);
+	check_error();
+    }
+    fi->firstblk = start;
+    file_update_dirent(fi);
+    check_error();
+    for (f = FSState.files; f; f = f->next)
+	if (f->first_block == old) {
+	    f->first_block = start;
+	    f->current_block = start + f->fileptr.block;
+	    f->last_block = start + count - 1;
+	    f->blocks = count;
+	    sparse_drop(f);
+	}
+    for (block = old; block; block = next) {
+	next = d->fat[block];
+	defrag_push(d, block);
+	check_error();
+    }
+    d->moved++;
+}
+
+/* exported functions */
+static void journal_init (block_t journal) {
+    FSState.journal = journal;
+    FSState.journal_freed = 0;
+    FSState.journal_max = (FSState.blocksize - sizeof(FSJournalHeader)) / sizeof(block_t);
+    if (FSState.journal_max > journal - 1)
+	FSState.journal_max = journal - 1;
+    FSState.journal_buf = (char*)calloc(journal + 1, FSState.blocksize);
+    if (!FSState.journal_buf)
+	fs_errno = FS_ENOMEM;
+}
+
+/* The FAT is built in memory, and written with a single write, bypassing
+   the journal, which is emptied first, as none of it applies anymore. */
+int format_fs () {
+    block_t first = rootdir() + 1 + FSState.journal, *fat;
+    int i, count;
+    fs_errno = FS_NOERR;
+    fat_load_block(0);
+    check_error_ret(-1);
+    /* a FAT of a single block is written whole anyway */
+    FSState.hwm = APFS_LAZY_FAT && rootdir() > 1 && first < FSState.maxblocks ?
+	first : FSState.maxblocks;
+    count = FSState.hwm < FSState.maxblocks ?
+	blk_divup((first + 8) * sizeof(block_t)) : rootdir();
+    fat = (block_t*)calloc(count, FSState.blocksize);
+    if (!fat) {
+	fs_errno = FS_ENOMEM;
+	return -1;
+    }
+    FSState.freeblocks = FSState.maxblocks - first;
+    FSState.orphans = FSState.orphanblocks = 0;
+    FSState.freeblock = first < FSState.maxblocks ? first : 0;
+    memcpy(fat, FSState.cachedfat, sizeof(FSInfoBlock));
+    ((FSInfoBlock*)fat)->freeblocks = FSState.freeblocks;
+    ((FSInfoBlock*)fat)->orphans = 0;
+    fat[8] = FSState.freeblock;
+    if (FSState.hwm < FSState.maxblocks)
+	fat[9] = FSState.hwm;
+    else
+	for (i = first; i + 1 < FSState.maxblocks; i++)
+	    fat[i + 8] = i + 1;
+    if (FSState.journal) {
+	journal_header()->count = 0;
+	FSState.journal_freed = 0;
+	journal_clear();
+    }
+    FSState.cachedfat_block = -1;
+    FSState.cachedfat_modified = 0;
+    if (!fs_errno)
+	write_disk_blocks(0, count, fat);
+    free(fat);
+    check_error_ret(-1);
+    init_dir_block(rootdir());
+    check_error_ret(-1);
+    journal_flush();
+    check_error_ret(-1);
+    return 0;
+}
+
+int create_fsex (char *fname, block_t blocksize, block_t blockcount) {
+    FSInfoBlock ib;
+    fs_errno = FS_NOERR;
+    ib.sig = 0x53465041;
+    /* a record holding a 255 chars name takes 268 bytes */
+    ib.version = blocksize >= 512 ? FS_VERSION : 1;
+    ib.blocksize = blocksize;
+    ib.maxblocks = blockcount;
+    FSState.maxblocks = ib.maxblocks;
+    set_blocksize(ib.blocksize);
+    FSState.version = ib.version;
+    ib.journal = (ib.maxblocks - rootdir()) / 16;
+    if (ib.journal > APFS_JOURNAL_BLOCKS)
+	ib.journal = APFS_JOURNAL_BLOCKS;
+    if (ib.journal < 2)
+	ib.journal = 0;
+    ib.freeblocks = ib.maxblocks - rootdir() - 1 - ib.journal;
+    ib.orphans = 0;
+    FSState.fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (FSState.fd < 0) {
+	fs_errno = FS_EOS;
+	return -1;
+    }
+    /* a sparse file: the data blocks take no space until written */
+    if (ftruncate(FSState.fd, (off_t)ib.maxblocks * ib.blocksize) < 0) {
+	close(FSState.fd);
+	fs_errno = FS_EOS;
+	return -1;
+    }
+    FSState.journal = 0;
+    FSState.reserved = 0;
+    FSState.mcache = NULL;
+    memset(&FSState.stats, 0, sizeof(FSStats));
+    FSState.cachedfat = (short int*)malloc(FSState.blocksize);
+    if (!FSState.cachedfat) {
+	fs_errno = FS_ENOMEM;
+	return -1;
+    }
+    FSState.cachedfat_block = 0;
+    FSState.cachedfat_modified = 1;
+    FSState.files = NULL;
+    read_block(0, FSState.cachedfat);
+    check_error_ret(-1);
+    memcpy(FSState.cachedfat, &ib, sizeof(ib));
+    journal_init(ib.journal);
+    check_error_ret(-1);
+    return format_fs();
+}
+
+int create_fs(char *fname, unsigned int size) {
+    int blocksize = 512;
+    while (size / 65535 > blocksize)
+        if (blocksize < 32768)
+	    blocksize <<= 1;
 	else 
     	    blocksize = 65535;
     return create_fsex(fname, blocksize, divup(size, blocksize));
 }
 
+/* Preloading reads the FAT, and then the directories a level of the tree at
+   a time, each level sorted by block and read in runs of consecutive
+   blocks, until budget bytes of copies are made. */
+#define PRELOAD_RUN 64
+
+typedef struct {
+    block_t *dirs;
+    int count;
+} FSPreload;
+
+static void preload_subdir (FSFileInfo *fi, void *arg) {
+    FSPreload *p = (FSPreload*)arg;
+    if ((fi->attrs & FATTR_DIRECTORY) && fi->firstblk && fi->firstblk < FSState.maxblocks &&
+	!FSState.mcache[fi->firstblk] && p->count < FSState.maxblocks)
+	p->dirs[p->count++] = fi->firstblk;
+}
+
+static int block_cmp (const void *a, const void *b) {
+    return *(block_t*)a - *(block_t*)b;
+}
+
+/* Copies the given blocks, buf taking PRELOAD_RUN of them. Returns 1 once
+   the budget is spent */
+static int preload_blocks (block_t *blocks, int count, char *buf, long budget) {
+    int i, j, n, k;
+    qsort(blocks, count, sizeof(block_t), block_cmp);
+    for (i = 0; i < count; i = j) {
+	for (j = i + 1; j < count && blocks[j] == blocks[j - 1] + 1 && j - i < PRELOAD_RUN; j++)
+	    ;
+	n = blk_div(budget - FSState.mcache_used);
+	if (n <= 0)
+	    return 1;
+	if (n > j - i)
+	    n = j - i;
+	read_disk_blocks(blocks[i], n, buf);
+	check_error_ret(1);
+	for (k = 0; k < n; k++) {
+	    if (FSState.mcache[blocks[i + k]])
+		continue;
+	    FSState.mcache[blocks[i + k]] = (char*)malloc(FSState.blocksize);
+	    if (!FSState.mcache[blocks[i + k]]) {
+		fs_errno = FS_ENOMEM;
+		return 1;
+	    }
+	    memcpy(FSState.mcache[blocks[i + k]], buf + k * FSState.blocksize, FSState.blocksize);
+	    FSState.mcache_used += FSState.blocksize;
+	    FSState.stats.preloaded++;
+	}
+	/* skip the same block listed twice */
+	while (j < count && blocks[j] == blocks[j - 1])
+	    j++;
+    }
+    return 0;
+}
+
+/* The index blocks of version 2 directories are left out, as lookups
+   seldom need more than a couple of them. */
+static void preload_metadata (long budget) {
+    FSPreload level, next, tmp;
+    FSDirSearchInfo dsinfo;
+    FSFileInfo fi;
+    char name[256], *buf;
+    block_t *blocks, block;
+    int i, count, hops, full;
+    FSState.mcache = (char**)calloc(FSState.maxblocks, sizeof(char*));
+    blocks = (block_t*)malloc(FSState.maxblocks * sizeof(block_t));
+    level.dirs = (block_t*)malloc(FSState.maxblocks * sizeof(block_t));
+    next.dirs = (block_t*)malloc(FSState.maxblocks * sizeof(block_t));
+    buf = (char*)malloc(PRELOAD_RUN * FSState.blocksize);
+    if (!FSState.mcache || !blocks || !level.dirs || !next.dirs || !buf) {
+	fs_errno = FS_ENOMEM;
+	goto done;
+    }
+    for (count = 0; count < rootdir(); count++)
+	blocks[count] = count;
+    full = preload_blocks(blocks, count, buf, budget);
+    level.dirs[0] = rootdir();
+    level.count = 1;
+    while (!full && level.count) {
+	/* the FAT lookups are served by the copies by now */
+	for (count = i = 0; i < level.count; i++)
+	    for (block = level.dirs[i], hops = 0; block && block < FSState.maxblocks &&
+		 hops < FSState.maxblocks && count < FSState.maxblocks; hops++) {
+		blocks[count++] = block;
+		block = read_fatentry(block);
+	    }
+	if (!fs_errno)
+	    full = preload_blocks(blocks, count, buf, budget);
+	if (fs_errno)
+	    break;
+	next.count = 0;
+	for (i = 0; i < level.count; i++) {
+	    dir_entries_init(&dsinfo, &fi);
+	    for (block = level.dirs[i], hops = 0; block && block < FSState.maxblocks &&
+		 FSState.mcache[block] && hops < FSState.maxblocks; hops++) {
+		if (dir_entries(FSState.mcache[block], block, level.dirs[i], &dsinfo, &fi,
+				name, preload_subdir, &next))
+		    break;
+		block = read_fatentry(block);
+	    }
+	}
+	tmp = level;
+	level = next;
+	next = tmp;
+    }
+done:
+    free(blocks);
+    free(level.dirs);
+    free(next.dirs);
+    free(buf);
+}
+
 int open_fs (char *fname) {
+    return open_fsex(fname, APFS_PRELOAD_BYTES);
+}
+
+int open_fsex (char *fname, long preload) {
     FSInfoBlock ib;
     char data[512];
+    int i;
     fs_errno = FS_NOERR;
+    FSState.mcache = NULL;
     FSState.fd = open(fname, O_RDWR);
     if (FSState.fd == -1) {
 	fs_errno = FS_EOS;
 	return -1;
     }
-    FSState.blocksize = 512;
+    set_blocksize(512);
     FSState.maxblocks = 1;
-    read_block(0, data);
+    read_disk_block(0, data);
     if (fs_errno) {
 	close(FSState.fd);
 	return -1;
     }
     memcpy(&ib, data, sizeof(ib));
     if (ib.sig != 0x53465041 || ib.blocksize < 16 || ib.maxblocks < 2 ||
-	ib.blocksize % 8 != 0) {
+	ib.blocksize % 8 != 0 || ib.journal == 1 ||
+	ib.journal >= ib.maxblocks - divup(ib.maxblocks * 2 + 16, ib.blocksize)) {
 	close(FSState.fd);
 	fs_errno = FS_EFORMAT;
 	return -1;
     }
-    if (ib.version != 1) {
+    if (ib.version < 1 || ib.version > FS_VERSION) {
 	close(FSState.fd);
 	fs_errno = FS_EVERSION;
 	return -1;
     }
+    FSState.maxblocks = ib.maxblocks;
+    set_blocksize(ib.blocksize);
+    FSState.version = ib.version;
+    FSState.freeblocks = ib.freeblocks;
     FSState.cachedfat_block = -1;
     FSState.cachedfat_modified = 0;
+    FSState.files = NULL;
+    memset(&FSState.stats, 0, sizeof(FSStats));
     FSState.cachedfat = (short int*)malloc(FSState.blocksize);
     if (!FSState.cachedfat) {
 	fs_errno = FS_ENOMEM;
 	return -1;
     }
-    FSState.maxblocks = ib.maxblocks;
-    FSState.blocksize = ib.blocksize;
-    FSState.freeblocks = ib.freeblocks;
+    journal_init(ib.journal);
+    if (!fs_errno && FSState.journal)
+	journal_replay();
+    if (fs_errno) {
+	close(FSState.fd);
+	return -1;
+    }
+    FSState.hwm = FSState.maxblocks;
+    FSState.reserved = 0;
     FSState.freeblock = read_fatentry(0);
+    check_error_ret(-1);
+    if (rootdir() > 1) {
+	i = read_fatentry(1);
+	check_error_ret(-1);
+	if (i > 0 && i < FSState.maxblocks)
+	    FSState.hwm = i;
+    }
+    /* the journal may have brought a newer count */
+    FSState.freeblocks = ((FSInfoBlock*)FSState.cachedfat)->freeblocks;
+    FSState.orphans = ((FSInfoBlock*)FSState.cachedfat)->orphans;
+    orphans_count();
+    check_error_ret(-1);
+    if (preload > 0)
+	preload_metadata(preload);
+    /* the copies are only a cache: the filesystem is usable without them */
+    if (fs_errno) {
+	mcache_free();
+	FSState.stats.preloaded = 0;
+	fs_errno = FS_NOERR;
+    }
     return 0;
 }
 
 void close_fs () {
     fs_errno = FS_NOERR;
-    flush_fat_cache();
+    flush_files();
+    if (!fs_errno)
+	reclaim_orphans();
+    if (!fs_errno)
+	journal_flush();
+    if (!fs_errno && FSState.journal && !fsync(FSState.fd))
+	journal_clear();
     FSState.cachedfat_block = -1;
     free(FSState.cachedfat);
+    free(FSState.journal_buf);
+    mcache_free();
     check_os_error(close(FSState.fd));
 }
 
-FSInfo *fs_info () {
-    static FSInfo result;
-    fs_errno = FS_NOERR;
-    result.blocksize = FSState.blocksize;
-    result.freeblocks = FSState.freeblocks;
-    result.totalblocks = FSState.maxblocks;
-    return &result;
+void fs_flush () {
+    trace_op(FSOP_FLUSH, NULL, NULL);
+    fs_errno = FS_NOERR;
+    flush_files();
+    check_error();
+    journal_flush();
+    check_error();
+    check_os_error(fsync(FSState.fd));
+}
+
+FSInfo *fs_info () {
+    static FSInfo result;
+    fs_errno = FS_NOERR;
+    result.blocksize = FSState.blocksize;
+    /* the orphans count as free, as they will be when they're needed */
+    result.freeblocks = FSState.freeblocks + FSState.orphanblocks - FSState.reserved;
+    result.totalblocks = FSState.maxblocks;
+    return &result;
+}
+
+void fs_stats (FSStats *st) {
+    *st = FSState.stats;
+}
+
+void fs_resetstats () {
+    memset(&FSState.stats, 0, sizeof(FSStats));
+}
+
+FSHistogram *fs_latency (int op) {
+#if APFS_TRACE
+    if (op >= 0 && op < FSOP_COUNT)
+	return &latency[op];
+#endif
+    return NULL;
+}
+
+/* Returns the lowest value of the bucket holding the given fraction of the
+   recorded latencies */
+unsigned long long fs_percentile (FSHistogram *h, double p) {
+    unsigned long n = 0, want = p * h->count;
+    int i;
+    if (!h->count)
+	return 0;
+    if (want >= h->count)
+	return h->max;
+    for (i = 0; i < FS_HIST_BUCKETS; i++) {
+	n += h->buckets[i];
+	if (n > want)
+	    break;
+    }
+    if (i < FS_HIST_SUB)
+	return i;
+    return (unsigned long long)(i % FS_HIST_SUB + FS_HIST_SUB) << (i / FS_HIST_SUB - 1);
+}
+
+void fs_resetlatency () {
+#if APFS_TRACE
+    memset(latency, 0, sizeof(latency));
+#endif
+}
+
+void fs_settrace (FSTraceFunc fn) {
+#if APFS_TRACE
+    tracefn = fn;
+#endif
+}
+
+/* Starts recording every call timed for fs_latency into the file fname, or
+   stops recording if it's NULL */
+int fs_record (char *fname) {
+    fs_errno = FS_NOERR;
+#if APFS_TRACE
+    if (tracefile)
+	fclose(tracefile);
+    tracefile = NULL;
+    if (!fname)
+	return 0;
+    tracefile = fopen(fname, "wb");
+    if (!tracefile || fwrite(FS_TRACE_MAGIC, 8, 1, tracefile) != 1) {
+	if (tracefile)
+	    fclose(tracefile);
+	tracefile = NULL;
+	fs_errno = FS_EOS;
+	return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    return 0;
+#else
+    if (fname)
+	fs_errno = FS_ENOPERM;
+    return fname ? -1 : 0;
+#endif
+}
+
+char *fs_opname (int op) {
+    static char *names[FSOP_COUNT] = {
+	"open", "close", "read", "write", "truncate", "mkdir", "rmdir",
+	"deltree", "findfirst", "findnext", "remove", "move", "rename",
+	"copy", "import", "export", "defrag", "compactdir", "flush", "fsync",
+	"walk"
+    };
+    return op >= 0 && op < FSOP_COUNT ? names[op] : NULL;
 }
 
 FSFile *fs_open (char *fname, int create) {
     FSFile *result;
     FSFileInfo *fi;
+    trace_op(FSOP_OPEN, fname, NULL);
+    trace_count(create);
     fs_errno = FS_NOERR;
+    journal_begin();
     fi = get_file_info(fname);
     if (fs_errno && fs_errno != FS_ENOENT)
 	return NULL;
@@ -618,18 +3197,44 @@ FSFile *fs_open (char *fname, int create) {
 	    fs_errno = FS_EISDIR;
 	    return NULL;
 	}
+	/* the file may have grown through another handle */
+	for (result = FSState.files; result; result = result->next)
+	    if ((result->sizedirty || result->dlen) && result->dirent.block == fi->dirent.block &&
+		result->dirent.offset == fi->dirent.offset) {
+		file_flush(result);
+		check_error_ret(NULL);
+		fi->size = result->file_size;
+		fi->firstblk = result->first_block;
+	    }
     }
-    result = (FSFile*)malloc(sizeof(FSFile));
+    result = file_get();
     if (!result) {
 	fs_errno = FS_ENOMEM;
 	return NULL;
     }
     result->first_block = fi->firstblk;
     result->current_block = fi->firstblk;
+    result->last_block = 0;
+    result->blocks = fi->firstblk ? -1 : 0;
+    result->ra_pos = 0;
+    result->ra_window = 0;
+    result->wbuf = NULL;
+    result->wblock = result->wdirty = result->sizedirty = 0;
+    result->dbuf = NULL;
+    result->dstart = result->dlen = result->dsize = 0;
+    result->sparse = (fi->attrs & FATTR_SPARSE) != 0;
+    result->map = NULL;
     result->seek_block = 0;
     result->file_size = fi->size;
     result->fileptr = (FSLocation) {0, 0};
     result->dirent = fi->dirent;
+    result->dir = fi->dir;
+    if (!++FSState.lastid)	/* 0 stands for no file */
+	FSState.lastid++;
+    result->id = FSState.lastid;
+    result->next = FSState.files;
+    FSState.files = result;
+    trace_file(result);
     return result;
 }
 
@@ -638,54 +3243,152 @@ typedef int (*funopen_write)(void *, const char *, int);
 typedef fpos_t (*funopen_seek)(void *, fpos_t, int);
 typedef int (*funopen_close)(void *);
 
-#if USE_FUNOPEN
+#if USE_FOPENCOOKIE
+/* A stream of fs_fopen. Its stdio buffer is allocated along with it, so
+   that the whole buffer is filled or flushed by a single fs_read or
+   fs_write, which moves runs of consecutive blocks at once */
+typedef struct {
+    FSFile *f;
+    char buf[APFS_FOPEN_BUFSIZE];
+} FSCookie;
+
+static ssize_t cookie_read (void *cookie, char *buf, size_t size) {
+    int rc = fs_read(((FSCookie*)cookie)->f, buf, size > INT_MAX ? INT_MAX : size);
+    if (rc < 0) {
+	errno = EIO;
+	return -1;
+    }
+    return rc;
+}
+
+static ssize_t cookie_write (void *cookie, const char *buf, size_t size) {
+    int rc = fs_write(((FSCookie*)cookie)->f, (void*)buf, size > INT_MAX ? INT_MAX : size);
+    if (rc < 0) {
+	errno = fs_errno == FS_ENOSPACE ? ENOSPC : EIO;
+	return 0;
+    }
+    return rc;
+}
+
+/* stdio keeps offsets in 64 bits, files here are limited to an int */
+static int cookie_seek (void *cookie, off64_t *offset, int whence) {
+    FSFile *f = ((FSCookie*)cookie)->f;
+    off64_t pos = *offset;
+    if (whence == SEEK_CUR)
+	pos += fs_tell(f);
+    else if (whence == SEEK_END)
+	pos += f->file_size;
+    if (pos < 0 || pos > INT_MAX) {
+	errno = pos < 0 ? EINVAL : EOVERFLOW;
+	return -1;
+    }
+    *offset = fs_seek(f, pos);
+    return 0;
+}
+
+static int cookie_close (void *cookie) {
+    int rc = fs_close(((FSCookie*)cookie)->f);
+    free(cookie);
+    return rc;
+}
+#endif /* USE_FOPENCOOKIE */
+
+#if USE_FUNOPEN || USE_FOPENCOOKIE
 FILE *fs_fopen (char *name, char *mode) {
-    int rd = 0, wr = 0, trunc = 0, append = 0;
+    int rd = 0, wr = 0, trunc = 0, append = 0, err;
     FSFile *f;
-    if (!strcmp(mode, "r"))
-	rd = 1;
-    else if (!strcmp(mode, "r+")) {
-	rd = 1;
-	wr = 1;
-    } else if (!strcmp(mode, "w"))
-	wr = 1;
-    else if (!strcmp(mode, "w+")) {
-	wr = 1;
-	rd = 1;
-	trunc = 1;
-    } else if (!strcmp(mode, "a")) {
-	wr = 1;
-	append = 1;
-    } else if (!strcmp(mode, "a+")) {
-	wr = 1;
-	rd = 1;
-	append = 1;
+#if USE_FOPENCOOKIE
+    cookie_io_functions_t io;
+    FSCookie *cookie;
+    FILE *stream;
+#endif
+    switch (mode[0]) {
+	case 'r':
+	    rd = 1;
+	    break;
+	case 'w':
+	    wr = 1;
+	    trunc = 1;
+	    break;
+	case 'a':
+	    wr = 1;
+	    append = 1;
+	    break;
+	default:
+	    fs_errno = FS_ENOPERM;
+	    return NULL;
     }
+    if (strchr(mode, '+'))
+	rd = wr = 1;
     f = fs_open(name, trunc || append);
     check_error_ret(NULL);
-    if (trunc) {
+    if (trunc)
 	fs_truncate(f);
-        check_error_ret(NULL);
-    }
-    if (append) {
+    else if (append)
 	fs_lseek(f, 0, SEEK_END);
-        check_error_ret(NULL);
+    if (fs_errno) {
+	err = fs_errno;
+	fs_close(f);
+	fs_errno = err;
+	return NULL;
+    }
+#if USE_FOPENCOOKIE
+    cookie = (FSCookie*)malloc(sizeof(FSCookie));
+    if (!cookie) {
+	fs_close(f);
+	fs_errno = FS_ENOMEM;
+	return NULL;
+    }
+    cookie->f = f;
+    io.read = rd ? cookie_read : NULL;
+    io.write = wr ? cookie_write : NULL;
+    io.seek = cookie_seek;
+    io.close = cookie_close;
+    stream = fopencookie(cookie, mode, io);
+    if (!stream) {
+	cookie_close(cookie);
+	fs_errno = FS_ENOMEM;
+	return NULL;
     }
+    if (APFS_FOPEN_BUFSIZE)
+	setvbuf(stream, cookie->buf, _IOFBF, APFS_FOPEN_BUFSIZE);
+    return stream;
+#else
     return funopen((void*)f, 
 		    rd ? (funopen_read)fs_read : NULL, 
 		    wr ? (funopen_write)fs_write : NULL,
 		    (funopen_seek)fs_lseek, (funopen_close)fs_close);
+#endif /* USE_FOPENCOOKIE */
 }
-#endif /* USE_FUNOPEN */
+#endif /* USE_FUNOPEN || USE_FOPENCOOKIE */
 		    
 int fs_close (FSFile *f) {
-    free(f);
-    return 0;
+    FSFile **p;
+    int err = fs_errno, rc;
+    trace_op(FSOP_CLOSE, NULL, NULL);
+    trace_file(f);
+    fs_errno = FS_NOERR;
+    file_flush(f);
+    rc = fs_errno ? -1 : 0;
+    if (!fs_errno)	/* keep the error of a call which failed and closes f */
+	fs_errno = err;
+    for (p = &FSState.files; *p; p = &(*p)->next)
+	if (*p == f) {
+	    *p = f->next;
+	    break;
+	}
+    block_put(f->wbuf);
+    free(f->dbuf);
+    sparse_drop(f);
+    file_put(f);
+    return rc;
 }
 
 int fs_mkdir (char *path) {
     FSFileInfo *fi;
+    trace_op(FSOP_MKDIR, path, NULL);
     fs_errno = FS_NOERR;
+    journal_begin();
     fi = get_file_info(path);
     if (fs_errno && fs_errno != FS_ENOENT)
 	return -1;
@@ -701,7 +3404,10 @@ int fs_mkdir (char *path) {
 
 FSFileInfo *fs_findfirst (char *directory, FSDirSearchInfo *dsinfo) {
     FSFileInfo *fi;
+    trace_op(FSOP_FINDFIRST, directory, NULL);
     fs_errno = FS_NOERR;
+    flush_files();
+    check_error_ret(NULL);
     fi = get_file_info(directory);
     check_error_ret(NULL);
     if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
@@ -715,59 +3421,515 @@ FSFileInfo *fs_findfirst (char *directory, FSDirSearchInfo *dsinfo) {
     return fs_findnext(dsinfo);
 }
 
-FSFileInfo *fs_findnext (FSDirSearchInfo *dsinfo) {
-    static FSFileInfo result;
-    int found = 0;
-    fs_errno = FS_NOERR;
+static FSFileInfo *dir_next_record (FSDirSearchInfo *dsinfo, FSFileInfo *result) {
+    FSDirRecord *rec;
+    while (1) {
+	rec = (FSDirRecord*)((char*)dsinfo->cache + dsinfo->dirent.offset);
+	if (dsinfo->dirent.offset + sizeof(FSDirRecord) > FSState.blocksize ||
+	    !rec->attrs || !rec->reclen) {
+	    dsinfo->dirent.block = read_fatentry(dsinfo->dirent.block);
+	    if (!fs_errno && dsinfo->dirent.block)
+		read_block(dsinfo->dirent.block, dsinfo->cache);
+	    if (fs_errno || !dsinfo->dirent.block) {
+		dir_search_end(dsinfo);
+		if (!fs_errno)
+		    dir_check_deleted(dsinfo->dir, dsinfo);
+		return NULL;
+	    }
+	    dsinfo->dirent.offset = 0;
+	    dsinfo->blocks++;
+	    continue;
+	}
+	dsinfo->dirent.offset += rec->reclen;
+	if (rec->attrs & FATTR_DELETED)
+	    dsinfo->deleted++;
+	if (rec->attrs & (FATTR_DELETED | FATTR_HEADER))
+	    continue;
+	dsinfo->live++;
+	record_file_info(rec, result, dsinfo->name, dsinfo->dir,
+			 (FSLocation){dsinfo->dirent.block, dsinfo->dirent.offset - rec->reclen});
+	return result;
+    }
+}
+
+static FSFileInfo *dir_search_next (FSDirSearchInfo *dsinfo, FSFileInfo *result) {
+    FSDirEntry *e;
+    int found = 0, skip;
     if (!dsinfo->cache)
 	return NULL;
+    if (FSState.version >= 2)
+	return dir_next_record(dsinfo, result);
+    result->dir = dsinfo->dir;
+    if (!dsinfo->dirent.block) {
+	dir_search_end(dsinfo);
+	dir_check_deleted(dsinfo->dir, dsinfo);
+	return NULL;
+    }
     while (1) {
-	switch (process_dir_entry(&dsinfo->cache[dsinfo->dirent.offset], &result, dsinfo, dsinfo->dirent)) {
+	e = &dsinfo->cache[dsinfo->dirent.offset];
+	if (dead_entry(*e) && (skip = dir_skip_deleted(dsinfo, result)))
+	    dsinfo->dirent.offset += skip - 1;
+	else switch (process_dir_entry(e, result, dsinfo, dsinfo->dirent)) {
 	    case -1:
-		free(dsinfo->cache);
-		dsinfo->cache = 0;
+		dir_search_end(dsinfo);
+		dir_check_deleted(dsinfo->dir, dsinfo);
 		return NULL;
 	    case 1:
 		found = 1;
 	}
-	if (++dsinfo->dirent.offset == FSState.blocksize / sizeof(FSDirEntry)) {
+	if (++dsinfo->dirent.offset == FSState.direntries) {
 	    dsinfo->dirent.block = read_fatentry(dsinfo->dirent.block);
 	    if (fs_errno) {
-		free(dsinfo->cache);
-		dsinfo->cache = 0;
+		dir_search_end(dsinfo);
 		return NULL;
 	    }
 	    if (dsinfo->dirent.block == 0) {
-		free(dsinfo->cache);
-		dsinfo->cache = 0;
-		if (found)
-		    return &result;
-		else
-		    return NULL;
+		if (found) /* end the search on the next call */
+		    return result;
+		dir_search_end(dsinfo);
+		dir_check_deleted(dsinfo->dir, dsinfo);
+		return NULL;
 	    }
 	    read_block(dsinfo->dirent.block, dsinfo->cache);
 	    if (fs_errno) {
-		free(dsinfo->cache);
-		dsinfo->cache = 0;
+		dir_search_end(dsinfo);
 		return NULL;
 	    }
 	    dsinfo->dirent.offset = 0;
+	    dsinfo->blocks++;
 	}
 	if (found)
-	    return &result;
+	    return result;
+    }
+}
+
+FSFileInfo *fs_findnext (FSDirSearchInfo *dsinfo) {
+    static FSFileInfo result;
+    trace_op(FSOP_FINDNEXT, NULL, NULL);
+    fs_errno = FS_NOERR;
+    return dir_search_next(dsinfo, &result);
+}
+
+/* Starts a search of directory, like fs_findfirst, but returns no entry:
+   they are read with fs_readdir_batch */
+int fs_opendir (char *directory, FSDirSearchInfo *dsinfo) {
+    FSFileInfo *fi;
+    block_t next;
+    trace_op(FSOP_FINDFIRST, directory, NULL);
+    fs_errno = FS_NOERR;
+    dsinfo->cache = NULL;
+    flush_files();
+    check_error_ret(-1);
+    fi = get_file_info(directory);
+    check_error_ret(-1);
+    if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
+	fs_errno = FS_ENOTDIR;
+	return -1;
+    }
+    if (!fi->firstblk)
+	return 0;
+    dir_search_init(fi, dsinfo);
+    check_error_ret(-1);
+    next = read_fatentry(dsinfo->dirent.block);
+    if (next)
+	prefetch_blocks(next, 1);
+    fs_errno = FS_NOERR;
+    return 0;
+}
+
+/* Copies up to n entries of a search started by fs_opendir to out, and
+   returns how many. 0 means the search is over. The next block of the
+   directory is hinted to the kernel as soon as the search enters a block,
+   so it is read while this one is parsed. */
+int fs_readdir_batch (FSDirSearchInfo *dsinfo, FSDirEntryOut *out, int n) {
+    FSFileInfo fi;
+    block_t block = dsinfo->dirent.block, next;
+    int count = 0;
+    trace_op(FSOP_FINDNEXT, NULL, &count);
+    fs_errno = FS_NOERR;
+    while (count < n && dir_search_next(dsinfo, &fi)) {
+	out[count].attrs = fi.attrs;
+	out[count].size = fi.size;
+	out[count].firstblk = fi.firstblk;
+	strcpy(out[count].name, fi.fname);
+	count++;
+	if (dsinfo->cache && dsinfo->dirent.block != block) {
+	    block = dsinfo->dirent.block;
+	    next = block ? read_fatentry(block) : 0;
+	    if (fs_errno)
+		break;
+	    if (next)
+		prefetch_blocks(next, 1);
+	}
+    }
+    if (fs_errno) {
+	fs_findend(dsinfo);
+	return -1;
+    }
+    return count;
+}
+
+/* Repacks the live entries of a directory at its start, and frees the
+   blocks left over. Entries only move towards the start, and each block is
+   rewritten after all the blocks before it, so an interrupted compaction
+   may leave an entry twice, but never loses one. Open files are updated to
+   the new location of their entries. Returns the count of blocks freed. */
+static int dir_compact (block_t dir) {
+    FSDirSearchInfo dsinfo;
+    FSFileInfo fi, *ents = NULL, *tmp;
+    FSDirEntry *e;
+    FSDirRecord *rec;
+    FSLocation loc;
+    FSFile *f;
+    scratch_block(char, blockdata);
+    int count = 0, size = 0, freeblocks = FSState.freeblocks, blocks = 1;
+    int i, n, len, slots, offset = 0;
+    block_t block = dir;
+    check_scratch_ret(blockdata, -1);
+    fi.firstblk = dir;
+    dir_search_init(&fi, &dsinfo);
+    check_error_ret(0);
+    FSState.searches++;
+    while (dir_search_next(&dsinfo, &fi)) {
+	if (count == size) {
+	    size = size ? size * 2 : 64;
+	    tmp = (FSFileInfo*)realloc(ents, size * sizeof(FSFileInfo));
+	    if (!tmp) {
+		fs_errno = FS_ENOMEM;
+		break;
+	    }
+	    ents = tmp;
+	}
+	ents[count] = fi;
+	if (!(ents[count++].fname = strdup(fi.fname))) {
+	    fs_errno = FS_ENOMEM;
+	    count--;
+	    break;
+	}
+    }
+    if (dsinfo.cache)
+	dir_search_end(&dsinfo);
+    if (fs_errno)
+	goto out;
+    memset(blockdata, 0, FSState.blocksize);
+    if (FSState.version >= 2) {
+	read_block(dir, blockdata);
+	if (fs_errno)
+	    goto out;
+	if (dir_index(blockdata))
+	    index_free(dir_index(blockdata));
+	if (fs_errno)
+	    goto out;
+	memset(blockdata, 0, FSState.blocksize);
+	rec = (FSDirRecord*)blockdata;
+	rec->attrs = FATTR_HEADER;
+	rec->reclen = offset = sizeof(FSDirRecord);
+    }
+    for (i = 0; i < count; i++) {
+	len = strlen(ents[i].fname);
+	slots = FSState.version >= 2 ? 1 : 1 + divup(len, 7);
+	for (n = 0; n < slots; n++) {
+	    if (FSState.version >= 2 ? offset + recsize(len) > FSState.blocksize :
+		offset == FSState.direntries) {
+		write_block(block, blockdata);
+		if (!fs_errno)
+		    block = read_alloc_fatentry(block, 1);
+		if (fs_errno)
+		    goto out;
+		memset(blockdata, 0, FSState.blocksize);
+		offset = 0;
+		blocks++;
+	    }
+	    if (FSState.version >= 2) {
+		rec = (FSDirRecord*)&blockdata[offset];
+		rec->attrs = ents[i].attrs;
+		rec->namelen = len;
+		rec->reclen = recsize(len);
+		rec->size = ents[i].size;
+		rec->firstblk = ents[i].firstblk;
+		rec->hash = name_hash(ents[i].fname, len);
+		memcpy(rec + 1, ents[i].fname, len);
+		loc = (FSLocation){block, offset};
+		offset += rec->reclen;
+		continue;
+	    }
+	    e = &((FSDirEntry*)blockdata)[offset];
+	    if (!n) {
+		e->attrs = ents[i].attrs;
+		e->chunkcount = slots - 1;
+		e->firstblk = ents[i].firstblk;
+		e->size = ents[i].size;
+		loc = (FSLocation){block, offset};
+	    } else {
+		e->attrs = n == slots - 1 ? FATTR_LASTCHUNK : FATTR_NAMECHUNK;
+		strncpy((char*)e + 1, &ents[i].fname[(n - 1) * 7], 7);
+	    }
+	    offset++;
+	}
+	for (f = FSState.files; f; f = f->next)
+	    if (f->dirent.block == ents[i].dirent.block &&
+		f->dirent.offset == ents[i].dirent.offset)
+		f->dirent = loc;
+    }
+    write_block(block, blockdata);
+    if (fs_errno)
+	goto out;
+    n = read_fatentry(block);
+    if (fs_errno)
+	goto out;
+    if (n) {
+	set_fatentry(block, 0);
+	if (!fs_errno)
+	    free_blocks(n);
+	if (fs_errno)
+	    goto out;
+    }
+    if (FSState.version >= 2 && blocks > APFS_DIRINDEX_BLOCKS)
+	dir_build_index(dir);
+out:
+    FSState.searches--;
+    for (i = 0; i < count; i++)
+	free(ents[i].fname);
+    free(ents);
+    return FSState.freeblocks - freeblocks;
+}
+
+/* Reads the entry at location ent of the directory dir */
+static FSFileInfo *dir_entry_at (block_t dir, FSLocation ent) {
+    static FSFileInfo result;
+    static char name[256];
+    FSDirSearchInfo dsinfo;
+    FSFileInfo fi;
+    fi.firstblk = ent.block;
+    dir_search_init(&fi, &dsinfo);
+    check_error_ret(NULL);
+    dsinfo.dir = dir;
+    dsinfo.dirent.offset = ent.offset;
+    if (!dir_search_next(&dsinfo, &result)) {
+	if (!fs_errno)
+	    fs_errno = FS_ENOENT;
+	return NULL;
+    }
+    if (dsinfo.cache)
+	dir_search_end(&dsinfo);
+    strcpy(name, result.fname);
+    result.fname = name;
+    return &result;
+}
+
+/* Tells whether the directory path is the directory d, or lies under it */
+static int path_inside (char *path, FSFileInfo *d) {
+    char tmp[strlen(path) + 1], *ptr = tmp;
+    FSFileInfo *fi;
+    strcpy(tmp, path);
+    do {
+	if ((ptr = strchr(ptr, '/')))
+	    *ptr = '\0';
+	fi = get_file_info(tmp);
+	if (!fi)
+	    return 0;
+	if (fi->dir == d->dir && fi->dirent.block == d->dirent.block &&
+	    fi->dirent.offset == d->dirent.offset)
+	    return 1;
+	if (ptr)
+	    *(ptr++) = '/';
+    } while (ptr);
+    return 0;
+}
+
+/* Links the entry src into the directory newpath (keeping its name), or as
+   newpath, or with rename set, as the name newpath in its own directory.
+   The new entry is added before the old one is removed, so a crash in the
+   middle leaves the file twice, but never loses it. The data blocks aren't
+   touched. */
+static void move_entry (FSFileInfo *src, char *newpath, int rename) {
+    FSFileInfo entry = *src, *fi;
+    char name[256], tmp[strlen(newpath) + 258], *ptr;
+    block_t dir;
+    FSFile *f;
+    int len;
+    if (!entry.dir) { /* the root directory */
+	fs_errno = FS_ENOPERM;
+	return;
+    }
+    strcpy(name, entry.fname);
+    /* lookups might otherwise compact the directories under our feet */
+    FSState.searches++;
+    while (*newpath == '/')
+	newpath++;
+    strcpy(tmp, newpath);
+    len = strlen(tmp);
+    while (len && tmp[len - 1] == '/')
+	tmp[--len] = '\0';
+    if (rename) {
+	if (!len || strchr(tmp, '/')) {
+	    fs_errno = FS_ENOPERM;
+	    goto out;
+	}
+	dir = entry.dir;
+	ptr = tmp;
+    } else {
+	fi = get_file_info(tmp);
+	if (fi && (fi->attrs & FATTR_DIRECTORY)) {
+	    sprintf(tmp + len, len ? "/%s" : "%s", name);
+	    fi = get_file_info(tmp);
+	}
+	if (fi) {
+	    fs_errno = FS_EEXIST;
+	    goto out;
+	}
+	if (fs_errno != FS_ENOENT)
+	    goto out;
+	fs_errno = FS_NOERR;
+	if ((ptr = strrchr(tmp, '/'))) {
+	    *(ptr++) = '\0';
+	    if ((entry.attrs & FATTR_DIRECTORY) && path_inside(tmp, &entry)) {
+		fs_errno = FS_ENOPERM;
+		goto out;
+	    }
+	    fi = get_file_info(tmp);
+	    if (!fi)
+		goto out;
+	    if (!(fi->attrs & FATTR_DIRECTORY)) {
+		fs_errno = FS_ENOTDIR;
+		goto out;
+	    }
+	    dir = fi->firstblk ? fi->firstblk : create_dir_first_entry(fi);
+	    if (fs_errno)
+		goto out;
+	} else {
+	    ptr = tmp;
+	    dir = rootdir();
+	}
+    }
+    if (find_dir_entry(dir, ptr)) {
+	fs_errno = FS_EEXIST;
+	goto out;
+    }
+    if (fs_errno)
+	goto out;
+    entry.fname = ptr;
+    add_dir_entry(dir, &entry);
+    if (fs_errno)
+	goto out;
+    dir_free_ent(src->dir, src->dirent);
+    if (fs_errno)
+	goto out;
+    for (f = FSState.files; f; f = f->next)
+	if (f->dir == src->dir && f->dirent.block == src->dirent.block &&
+	    f->dirent.offset == src->dirent.offset) {
+	    f->dir = entry.dir;
+	    f->dirent = entry.dirent;
+	}
+out:
+    FSState.searches--;
+}
+
+/* Chains collected by fs_deltree, to be freed all at once */
+typedef struct {
+    block_t *heads;
+    int count, size;
+} FSChains;
+
+static void chains_add (FSChains *c, block_t block) {
+    block_t *tmp;
+    if (!block)
+	return;
+    if (c->count == c->size) {
+	c->size = c->size ? c->size * 2 : 64;
+	tmp = (block_t*)realloc(c->heads, c->size * sizeof(block_t));
+	if (!tmp) {
+	    fs_errno = FS_ENOMEM;
+	    return;
+	}
+	c->heads = tmp;
+    }
+    c->heads[c->count++] = block;
+}
+
+static void index_chains (block_t node, FSChains *c) {
+    scratch_block(char, buf);
+    FSIndexNode *n = (FSIndexNode*)buf;
+    int i;
+    check_scratch(buf);
+    read_block(node, buf);
+    check_error();
+    for (i = 0; n->level && i < n->count; i++) {
+	index_chains(index_entries(n)[i].block, c);
+	check_error();
+    }
+    chains_add(c, node);
+}
+
+/* Collects the chains of the directory dir, and of everything under it */
+static void tree_chains (block_t dir, FSChains *c) {
+    scratch_block(char, blockdata);
+    FSDirSearchInfo dsinfo;
+    FSFileInfo fi;
+    check_scratch(blockdata);
+    if (!dir)
+	return;
+    if (FSState.version >= 2) {
+	read_block(dir, blockdata);
+	check_error();
+	if (dir_index(blockdata))
+	    index_chains(dir_index(blockdata), c);
+	check_error();
+    }
+    fi.firstblk = dir;
+    dir_search_init(&fi, &dsinfo);
+    check_error();
+    while (dir_search_next(&dsinfo, &fi)) {
+	if (fi.attrs & FATTR_DIRECTORY)
+	    tree_chains(fi.firstblk, c);
+	else
+	    chains_add(c, fi.firstblk);
+	if (fs_errno)
+	    break;
+    }
+    if (dsinfo.cache)
+	dir_search_end(&dsinfo);
+    check_error();
+    chains_add(c, dir);
+}
+
+/* Links the chains one after the other, in front of the free list, and
+   updates the free count once */
+static void free_chains (FSChains *c) {
+    block_t tail;
+    int i, next, count = 0;
+    if (!c->count)
+	return;
+    for (i = 0; i < c->count; i++) {
+	for (tail = c->heads[i]; ; tail = next) {
+	    count++;
+	    next = read_fatentry(tail);
+	    check_error();
+	    if (!next)
+		break;
+	}
+	set_fatentry(tail, i + 1 < c->count ? c->heads[i + 1] : FSState.freeblock);
+	check_error();
     }
+    set_fatentry(0, c->heads[0]);
+    check_error();
+    FSState.freeblock = c->heads[0];
+    FSState.freeblocks += count;
+    FSState.journal_freed = 1;
+    update_free_space();
 }
 
 void fs_findend (FSDirSearchInfo *dsinfo) {
     if (dsinfo->cache)
-	free(dsinfo->cache);
-    dsinfo->cache = 0;
+	dir_search_end(dsinfo);
 }
 
 int fs_rmdir (char *path) {
-    FSFileInfo *fi;
+    FSFileInfo *fi, *found;
     FSDirSearchInfo dsinfo;
+    trace_op(FSOP_RMDIR, path, NULL);
     fs_errno = FS_NOERR;
+    journal_begin();
     fi = get_file_info(path);
     check_error_ret(-1);
     if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
@@ -782,18 +3944,167 @@ int fs_rmdir (char *path) {
     if (fi->firstblk) {
 	dir_search_init(fi, &dsinfo);
 	check_error_ret(-1);
-	if (fs_findnext(&dsinfo)) {
+	/* the directory is going away, there's no point compacting it */
+	FSState.searches++;
+	found = fs_findnext(&dsinfo);
+	if (found)
 	    fs_findend(&dsinfo);
+	FSState.searches--;
+	if (found) {
 	    fs_errno = FS_ENOTEMPTY;
 	    return -1;
 	} else
 	    check_error_ret(-1);
     }
+    if (fi->firstblk && FSState.version >= 2) {
+	scratch_block(char, blockdata);
+	check_scratch_ret(blockdata, -1);
+	read_block(fi->firstblk, blockdata);
+	check_error_ret(-1);
+	if (dir_index(blockdata))
+	    index_free(dir_index(blockdata));
+	check_error_ret(-1);
+    }
     free_blocks(fi->firstblk);
     check_error_ret(-1);
-    dir_free_ent(fi->dirent);
+    dir_free_ent(fi->dir, fi->dirent);
+    check_error_ret(-1);
+    return 0;
+}
+
+int fs_deltree (char *path) {
+    FSFileInfo *fi, dir;
+    FSChains c = {NULL, 0, 0};
+    trace_op(FSOP_DELTREE, path, NULL);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    fi = get_file_info(path);
+    check_error_ret(-1);
+    if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
+	fs_errno = FS_ENOTDIR;
+	return -1;
+    }
+    if (fi->firstblk == rootdir()) {
+	fs_errno = FS_ENOPERM;
+	return -1;
+    }
+    dir = *fi;
+    /* the tree is going away, there's no point compacting it */
+    FSState.searches++;
+    tree_chains(dir.firstblk, &c);
+    FSState.searches--;
+    if (!fs_errno)
+	dir_free_ent(dir.dir, dir.dirent);
+    if (!fs_errno)
+	free_chains(&c);
+    free(c.heads);
+    return fs_errno ? -1 : 0;
+}
+
+int fs_fraginfo (char *path, FSFragInfo *st) {
+    FSFileInfo *fi, file;
+    int block, prev = 0;
+    fs_errno = FS_NOERR;
+    memset(st, 0, sizeof(FSFragInfo));
+    fi = get_file_info(path);
+    check_error_ret(-1);
+    if (fi->attrs & FATTR_DIRECTORY)
+	tree_files(path, frag_file, st);
+    else {
+	file = *fi;
+	frag_file(&file, st);
+    }
+    check_error_ret(-1);
+    for (block = FSState.freeblock; block; prev = block, block = read_fatentry(block)) {
+	check_error_ret(-1);
+	if (block != prev + 1)
+	    st->freeextents++;
+    }
+    return 0;
+}
+
+/* Relocates every file under path (or the file path) into a contiguous run
+   of blocks, then rebuilds the free list in ascending order, so that later
+   allocations are contiguous as well. Returns the count of files moved. */
+int fs_defrag (char *path) {
+    FSDefrag d;
+    FSFileInfo *fi, file;
+    block_t block, last = 0;
+    trace_op(FSOP_DEFRAG, path, NULL);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    /* the maps of sparse files are copied from their home blocks */
+    journal_flush();
+    check_error_ret(-1);
+    fi = get_file_info(path);
+    check_error_ret(-1);
+    file = *fi;
+    d.fat = (block_t*)malloc(FSState.maxblocks * sizeof(block_t));
+    d.prev = (block_t*)malloc(FSState.maxblocks * sizeof(block_t));
+    d.isfree = (char*)calloc(FSState.maxblocks, 1);
+    d.moved = 0;
+    if (!d.fat || !d.prev || !d.isfree) {
+	fs_errno = FS_ENOMEM;
+	goto out;
+    }
+    for (block = 0; block < FSState.maxblocks; block++) {
+	d.fat[block] = read_fatentry(block);
+	if (fs_errno)
+	    goto out;
+    }
+    for (block = FSState.freeblock; block; last = block, block = d.fat[block]) {
+	d.isfree[block] = 1;
+	d.prev[block] = last;
+    }
+    /* compacting a directory would change the FAT behind our back */
+    FSState.searches++;
+    if (file.attrs & FATTR_DIRECTORY)
+	tree_files(path, defrag_file, &d);
+    else
+	defrag_file(&file, &d);
+    FSState.searches--;
+    if (fs_errno)
+	goto out;
+    for (block = FSState.maxblocks - 1, last = 0; block > 0; block--)
+	if (d.isfree[block]) {
+	    if (d.fat[block] != last)
+		set_fatentry(block, last);
+	    if (fs_errno)
+		goto out;
+	    last = block;
+	}
+    set_fatentry(0, last);
+    FSState.freeblock = last;
+out:
+    free(d.fat);
+    free(d.prev);
+    free(d.isfree);
+    return fs_errno ? -1 : d.moved;
+}
+
+int fs_compactdir (char *path) {
+    FSFileInfo *fi;
+    int freed;
+    trace_op(FSOP_COMPACTDIR, path, NULL);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    fi = get_file_info(path);
     check_error_ret(-1);
-    return 0;
+    if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
+	fs_errno = FS_ENOTDIR;
+	return -1;
+    }
+    if (!fi->firstblk)
+	return 0;
+    freed = dir_compact(fi->firstblk);
+    check_error_ret(-1);
+    return freed;
 }
 
 void fs_perror (char *string) {
@@ -811,7 +4122,8 @@ void fs_perror (char *string) {
 	"Invalid filesystem version",
 	"Directory is not empty",
 	"Out of memory",
-	"Operation not permitted"
+	"Operation not permitted",
+	"No data past the offset"
     };
     int err;
     if (fs_errno >= sizeof(errors) / sizeof(errors[0]))
@@ -831,81 +4143,118 @@ void fs_perror (char *string) {
 
 int fs_remove (char *fname) {
     FSFileInfo *fi;
+    trace_op(FSOP_REMOVE, fname, NULL);
     fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
     fi = get_file_info(fname);
     check_error_ret(-1);
     if (fi->attrs & FATTR_DIRECTORY) {
 	fs_errno = FS_EISDIR;
 	return -1;
     }
-    free_blocks(fi->firstblk);
+    free_file_blocks(fi->firstblk, fi->size, fi->attrs & FATTR_SPARSE);
     check_error_ret(-1);
-    dir_free_ent(fi->dirent);
+    dir_free_ent(fi->dir, fi->dirent);
     check_error_ret(-1);
     return 0;
 }
 
 void fs_removef (FSFile *f) {
+    trace_op(FSOP_REMOVE, NULL, NULL);
+    trace_file(f);
     fs_errno = FS_NOERR;
-    free_blocks(f->first_block);
+    journal_begin();
+    file_discard(f->dirent);
+    free_file_blocks(f->first_block, f->file_size, f->sparse);
     check_error();
-    dir_free_ent(f->dirent);
+    dir_free_ent(f->dir, f->dirent);
     check_error();
     fs_close(f);
 }
 
-/* The following things should be done: 
-  1. resolve both filenames.
-     If first is unresolvable, then ENOENT.
-     If the second is resolvable, then filename = newpath, directory = second
-     else try to resolve the path of the second. if not resolvable, return error,
-     otherwise filename = what comes after /, directory = resolved entry.
-  2.
-  
-  THIS CODE IS NOT READY YET !
-*/
-/*
 int fs_move (char *name, char *newpath) {
-    FSFileInfo *fi, *fi2;
-    int len = strlen(newpath);
-    char *newname, tmp[len + 1], *ptr;
+    FSFileInfo *fi, src;
+    trace_op(FSOP_MOVE, name, NULL);
+    trace_path2(newpath);
     fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
     fi = get_file_info(name);
     check_error_ret(-1);
-    fi2 = get_file_info(newname);
-    if (fs_errno && fs_errno != FS_ENOENT)
-	return -1;
-    // XXX directory can't be moved inside itself
-    if (fi2) {
-	if ((fi2->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
-	    fs_errno = FS_EEXIST;
-	    return -1;
-	}
-        strcpy(tmp, name);
-	while(tmp[len?len-1:0] == '/' && len)
-	    tmp[--len] = NULL;
-	ptr = strrchr(tmp, "/");
-	if (!ptr)
-	    newname = tmp;
-	else
-	    newname = ptr + 1;
-    } else {
-        strcpy(tmp, newpath);
-	while(tmp[len?len-1:0] == '/' && len)
-	    tmp[--len] = NULL;
-	ptr = strrchr(tmp, "/");
-	if (ptr)
-    }
+    src = *fi;
+    move_entry(&src, newpath, 0);
+    return fs_errno ? -1 : 0;
+}
+
+int fs_rename (char *name, char *newname) {
+    FSFileInfo *fi, src;
+    trace_op(FSOP_RENAME, name, NULL);
+    trace_path2(newname);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    fi = get_file_info(name);
+    check_error_ret(-1);
+    src = *fi;
+    move_entry(&src, newname, 1);
+    return fs_errno ? -1 : 0;
+}
+
+int fs_movef (FSFile *f, char *newpath) {
+    FSFileInfo *fi, src;
+    trace_op(FSOP_MOVE, NULL, NULL);
+    trace_file(f);
+    trace_path2(newpath);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    fi = dir_entry_at(f->dir, f->dirent);
+    check_error_ret(-1);
+    src = *fi;
+    move_entry(&src, newpath, 0);
+    return fs_errno ? -1 : 0;
+}
+
+int fs_renamef (FSFile *f, char *newname) {
+    FSFileInfo *fi, src;
+    trace_op(FSOP_RENAME, NULL, NULL);
+    trace_file(f);
+    trace_path2(newname);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    fi = dir_entry_at(f->dir, f->dirent);
+    check_error_ret(-1);
+    src = *fi;
+    move_entry(&src, newname, 1);
+    return fs_errno ? -1 : 0;
 }
-*/
+
 int fs_read (FSFile *f, void *buf, int count) {
-    char blockdata[FSState.blocksize];
+    scratch_block(char, blockdata);
     int readcnt = 0, foffset, nextread;
+    trace_op(FSOP_READ, NULL, &readcnt);
+    trace_file(f);
+    trace_count(count);
+    check_scratch_ret(blockdata, -1);
     fs_errno = FS_NOERR;
-    if (count < 1)
+    if (count < 1 || fs_tell(f) >= f->file_size)
 	return 0;
+    if (f->sparse) {
+	readcnt = sparse_read(f, (char*)buf, count);
+	return readcnt;
+    }
+    file_sync_data(f);
+    check_error_ret(-1);
     file_perform_seek(f);
     check_error_ret(-1);
+    file_readahead(f, count);
     while (1) {
 	nextread = -1;
         foffset = f->fileptr.block * FSState.blocksize + f->fileptr.offset;
@@ -920,141 +4269,940 @@ int fs_read (FSFile *f, void *buf, int count) {
 	if (nextread > 0 || f->fileptr.offset) {
 	    int cnt = nextread > 0 && nextread < FSState.blocksize - f->fileptr.offset ? 
 		      nextread : FSState.blocksize - f->fileptr.offset;
-	    read_block(f->current_block, blockdata);
+	    read_disk_block(f->current_block, blockdata);
 	    if (fs_errno)
 		break;
-	    memcpy((void*)((int)buf + readcnt), (void*)((int)blockdata + f->fileptr.offset), cnt);
+	    memcpy((char*)buf + readcnt, blockdata + f->fileptr.offset, cnt);
 	    readcnt += cnt;
 	    f->fileptr.offset += cnt;
 	    if (f->fileptr.offset >= FSState.blocksize) {
-		f->fileptr.offset %= 512;
+		f->fileptr.offset = 0;
 		f->seek_block++;
 	    }
 	} else {
-	    read_block(f->current_block, (void*)((int)buf + readcnt));
+	    /* whole blocks go straight to the caller, a run of consecutive
+	       blocks at a time */
+	    int run = blk_div(count - readcnt);
+	    block_t next;
+	    if (run > blk_div(f->file_size - foffset))
+		run = blk_div(f->file_size - foffset);
+	    run = chain_run(f->current_block, run, &next);
+	    if (fs_errno)
+		break;
+	    read_disk_blocks(f->current_block, run, (char*)buf + readcnt);
 	    if (fs_errno)
 		break;
-	    readcnt += FSState.blocksize;
-	    f->seek_block++;
+	    readcnt += run * FSState.blocksize;
+	    f->seek_block += run;
+	    f->fileptr.block += run - 1;
+	    f->current_block += run - 1;
         }
 	if (f->seek_block > f->fileptr.block) {
 	    int nextblk = read_fatentry(f->current_block);
 	    f->fileptr.block++;
-	    if (!nextblk)	/* XXX should never happen */
+	    if (!nextblk) {	/* XXX should never happen */
+		f->last_block = f->current_block;
+		f->blocks = f->fileptr.block;
 		break;
+	    }
 	    f->current_block = nextblk; 
 	}
     }
+    f->ra_pos = fs_tell(f);
     return readcnt;
 }
 
 int fs_write (FSFile *f, void *buf, int count) {
-    char blockdata[FSState.blocksize];
     int written = 0, 	/* how many bytes were written so far ? */
 	newblocks = 0,  /* have we allocated new blocks ? */
-	nextblk = 1;	/* holds the pointer to the next block of the file */
+	nextblk = 1,	/* holds the pointer to the next block of the file */
+	delayed;	/* taken by file_delay */
+    block_t tail;
+    trace_op(FSOP_WRITE, NULL, &written);
+    trace_file(f);
+    trace_count(count);
     fs_errno = FS_NOERR;
+    journal_begin();
     if (count < 1)
 	return 0;
-    file_perform_seek(f);
-    check_error_ret(-1);
+    if (fs_tell(f) > f->file_size) {
+	file_extend(f, fs_tell(f));
+	check_error_ret(-1);
+    }
+    if (f->sparse) {
+	written = sparse_write(f, (char*)buf, count);
+	return written;
+    }
     while (1) {
-	if (f->fileptr.block >= divup(f->file_size, FSState.blocksize) && !newblocks) {
-	    int newblock = allocate_blocks(divup(count - written, FSState.blocksize));
+	if (count == written)
+	    break;
+	if (file_delayed(f)) {
+	    delayed = file_delay(f, (char*)buf + written, count - written);
+	    if (delayed < 0)
+		break;
+	    written += delayed;
+	    continue;
+	}
+	file_perform_seek(f);
+	if (fs_errno)
+	    break;
+	if (f->fileptr.block >= blk_divup(f->file_size) && !newblocks) {
+	    int newcount = blk_divup(count - written);
+	    int newblock = allocate_blocks(newcount, &tail);
 	    if (fs_errno)
 		break;
 	    if (f->current_block) {
 		set_fatentry(f->current_block, newblock);
 	    } else {
+		/* the chain must be reachable from the directory at once, or
+		   a crash before the size gets written would leak it */
 		f->first_block = newblock;
+		set_file_size(f, f->file_size);
+		if (fs_errno)
+		    break;
 	    }
+	    /* the chain grew by newcount blocks, if it ended at current_block */
+	    if (f->blocks >= 0 && f->current_block == f->last_block) {
+		f->last_block = tail;
+		f->blocks += newcount;
+	    } else
+		f->blocks = -1;
 	    f->current_block = newblock;
 	    newblocks = 1;
 	}
-	if (count == written)
-	    break;
 	if (count - written < FSState.blocksize || f->fileptr.offset) {
 	    int cnt = count - written < FSState.blocksize - f->fileptr.offset ?
 		      count - written : FSState.blocksize - f->fileptr.offset;
-	    if (newblocks)
-		memset(blockdata, 0, sizeof(blockdata));
-	    else
-		read_block(f->current_block, blockdata);
-	    if (fs_errno)
-		break;
-	    memcpy((void*)((int)blockdata + f->fileptr.offset), (void*)((int)buf + written), cnt);
-	    write_block(f->current_block, blockdata);
-	    if (fs_errno)
-		break;
+	    /* partial blocks gather in the handle's buffer, and go to the
+	       disk once they are complete, or the handle moves away */
+	    if (f->wblock != f->current_block) {
+		file_write_back(f);
+		if (fs_errno)
+		    break;
+		if (!f->wbuf && !(f->wbuf = block_get())) {
+		    fs_errno = FS_ENOMEM;
+		    break;
+		}
+		if (newblocks)
+		    memset(f->wbuf, 0, FSState.blocksize);
+		else {
+		    file_claim_block(f, f->current_block);
+		    if (!fs_errno)
+			read_disk_block(f->current_block, f->wbuf);
+		}
+		if (fs_errno)
+		    break;
+		f->wblock = f->current_block;
+	    }
+	    memcpy(f->wbuf + f->fileptr.offset, (char*)buf + written, cnt);
+	    f->wdirty = 1;
 	    written += cnt;
 	    f->fileptr.offset += cnt;
 	    if (f->fileptr.offset >= FSState.blocksize) {
-		f->fileptr.offset %= 512;
+		f->fileptr.offset = 0;
 		f->seek_block++;
+		file_write_back(f);
+		if (fs_errno)
+		    break;
 	    }
 	} else {
-	    write_block(f->current_block, (void*)((int)buf + written));
+	    int run = blk_div(count - written);
+	    block_t next;
+	    run = chain_run(f->current_block, run, &next);
+	    if (fs_errno)
+		break;
+	    file_drop_buffers(f->current_block, run);
+	    write_disk_blocks(f->current_block, run, (char*)buf + written);
 	    if (fs_errno)
 		break;
-	    written += FSState.blocksize;
-	    f->seek_block++;
+	    written += run * FSState.blocksize;
+	    f->seek_block += run;
+	    f->fileptr.block += run - 1;
+	    f->current_block += run - 1;
         }
 	if (f->seek_block > f->fileptr.block) {
 	    nextblk = read_fatentry(f->current_block);
 	    f->fileptr.block++;
 	    if (nextblk) {
 		f->current_block = nextblk; 
+	    } else {
+		f->last_block = f->current_block;
+		f->blocks = f->fileptr.block;
 	    }
 	}
     }
-    if (f->fileptr.block * FSState.blocksize + f->fileptr.offset >= f->file_size)
-	set_file_size(f, f->fileptr.block * FSState.blocksize + f->fileptr.offset);
+    /* the directory entry catches up at fs_close, fs_fsync or fs_flush */
+    if (f->fileptr.block * FSState.blocksize + f->fileptr.offset > f->file_size) {
+	f->file_size = f->fileptr.block * FSState.blocksize + f->fileptr.offset;
+	f->sizedirty = 1;
+    }
     return written;
 }
 
+/* Seeking past the end is allowed: a write there fills the gap, see
+   file_extend */
 int fs_seek (FSFile *f, int offset) {
-    if (offset > f->file_size)
-	offset = f->file_size;
+    file_write_back(f);
+    if (offset > file_limit())
+	offset = file_limit();
     else if (offset < 0)
 	offset = 0;
-    f->seek_block = offset / FSState.blocksize;
-    f->fileptr.offset = offset % FSState.blocksize;
+    f->seek_block = blk_div(offset);
+    f->fileptr.offset = blk_mod(offset);
     return offset;
 }
 
 int fs_lseek (FSFile *f, int offset, int whence) {
+    file_write_back(f);
     switch (whence) {
 	case SEEK_CUR:
 	    offset += f->fileptr.offset + f->seek_block * FSState.blocksize;
 	    break;
 	case SEEK_END:
 	    offset += f->file_size; 
+	    break;
+#ifdef SEEK_DATA
+	case SEEK_DATA:
+	    return fs_seek_data(f, offset);
+	case SEEK_HOLE:
+	    return fs_seek_hole(f, offset);
+#endif
     }
-    if (offset > f->file_size)
-        offset = f->file_size;
-    else if (offset < 0)
-        offset = 0;
-    f->seek_block = offset / FSState.blocksize;
-    f->fileptr.offset = offset % FSState.blocksize;
-    return offset;
+    return fs_seek(f, offset);
 }
 
 int fs_tell (FSFile *f) {
     return f->seek_block * FSState.blocksize + f->fileptr.offset;
 }
 
+/* Moves to the first byte of data at or past offset. Files which aren't
+   sparse are data up to their end. */
+int fs_seek_data (FSFile *f, int offset) {
+    FSBlockMap *m;
+    int k;
+    fs_errno = FS_NOERR;
+    if (offset < 0)
+	offset = 0;
+    if (f->sparse && offset < f->file_size) {
+	m = sparse_load(f);
+	check_error_ret(-1);
+	k = sparse_find(m, blk_div(offset));
+	if (k == m->count)
+	    offset = f->file_size;
+	else if ((long long)m->logical[k] * FSState.blocksize > offset)
+	    offset = m->logical[k] * FSState.blocksize;
+    }
+    if (offset >= f->file_size) {
+	fs_errno = FS_ENXIO;
+	return -1;
+    }
+    return fs_seek(f, offset);
+}
+
+/* Moves to the first byte of a hole at or past offset. The end of the
+   file counts as one. */
+int fs_seek_hole (FSFile *f, int offset) {
+    FSBlockMap *m;
+    unsigned int block;
+    int k;
+    fs_errno = FS_NOERR;
+    if (offset < 0)
+	offset = 0;
+    if (offset >= f->file_size) {
+	fs_errno = FS_ENXIO;
+	return -1;
+    }
+    if (f->sparse) {
+	m = sparse_load(f);
+	check_error_ret(-1);
+	block = blk_div(offset);
+	for (k = sparse_find(m, block); k < m->count && m->logical[k] == block; k++)
+	    block++;
+	if ((long long)block * FSState.blocksize > offset)
+	    offset = (long long)block * FSState.blocksize < f->file_size ?
+		     block * FSState.blocksize : f->file_size;
+    } else
+	offset = f->file_size;
+    return fs_seek(f, offset);
+}
+
 int fs_truncate (FSFile *f) {
-    int nextblk;
-    if (f->fileptr.block * FSState.blocksize + f->fileptr.offset >= f->file_size)
+    int nextblk, keep, pos;
+    block_t first, last;
+    FSFile *h;
+    trace_op(FSOP_TRUNCATE, NULL, NULL);
+    trace_file(f);
+    if (fs_tell(f) == f->file_size)
 	return 0;
     fs_errno = FS_NOERR;
-    nextblk = read_fatentry(f->current_block);
-    free_blocks(nextblk);
+    journal_begin();
+    if (fs_tell(f) > f->file_size) {
+	file_extend(f, fs_tell(f));
+	return fs_errno ? -1 : 0;
+    }
+    if (f->sparse) {
+	sparse_truncate(f, fs_tell(f));
+	check_error_ret(-1);
+	for (h = FSState.files; h; h = h->next)
+	    if (h->first_block == f->first_block)
+		h->sizedirty = 0;
+	return 0;
+    }
+    file_sync_data(f);
     check_error_ret(-1);
-    set_file_size(f, f->fileptr.block * FSState.blocksize + f->fileptr.offset);    
+    /* the blocks holding a byte before the cut are kept, and the chain is
+       cut after the last of them */
+    pos = fs_tell(f);
+    keep = blk_divup(pos);
+    if (keep) {
+	f->seek_block = keep - 1;
+	file_perform_seek(f);
+	check_error_ret(-1);
+	nextblk = read_fatentry(f->current_block);
+	check_error_ret(-1);
+    } else
+	nextblk = f->first_block;
+    if (nextblk) {
+	h = file_find_tail(f->first_block);
+	if (h && h->blocks > keep)
+	    splice_free(nextblk, h->last_block, h->blocks - keep);
+	else
+	    orphan_chain(nextblk, blk_divup(f->file_size) - keep);
+	check_error_ret(-1);
+	if (keep)
+	    set_fatentry(f->current_block, 0);
+	check_error_ret(-1);
+    }
+    first = keep ? f->first_block : 0;
+    last = keep ? f->current_block : 0;
+    /* the other handles walk the chain again from its start */
+    for (h = FSState.files; h; h = h->next)
+	if (h != f && h->first_block == f->first_block) {
+	    h->first_block = h->current_block = first;
+	    h->fileptr.block = 0;
+	    h->last_block = last;
+	    h->blocks = keep;
+	    h->ra_window = 0;
+	    h->wblock = h->sizedirty = 0;
+	}
+    /* and this one is left at the cut, which is past the end of the
+       chain when the cut is at a block boundary */
+    f->first_block = first;
+    f->current_block = f->last_block = last;
+    f->seek_block = f->fileptr.block = blk_div(pos);
+    f->blocks = keep;
+    f->ra_window = 0;
+    f->wblock = f->sizedirty = 0;
+    set_file_size(f, pos);
     return fs_errno ? -1 : 0;
 }
 
+int fs_fsync (FSFile *f) {
+    trace_op(FSOP_FSYNC, NULL, NULL);
+    trace_file(f);
+    fs_errno = FS_NOERR;
+    file_flush(f);
+    check_error_ret(-1);
+    journal_flush();
+    check_error_ret(-1);
+    if (fsync(FSState.fd) < 0) {
+	fs_errno = FS_EOS;
+	return -1;
+    }
+    return 0;
+}
+
 int fs_getfilesize (FSFile *f) {
     return f->file_size;
 }
+
+/* Copies len bytes between two descriptors, at *inoff and *outoff, or at the
+   current position of a descriptor whose offset pointer is NULL. The data
+   is moved inside the kernel where possible, falling back to read/write
+   for descriptors copy_file_range and sendfile can't handle. Returns the
+   number of bytes copied, which is short only at the end of the input */
+static int copy_range (int in, off_t *inoff, int out, off_t *outoff, int len) {
+    char *buf __attribute__((cleanup(scratch_free))) = NULL;
+    int done = 0, rc = 0, cnt;
+#if USE_COPY_FILE_RANGE
+    while (done < len) {
+	rc = copy_file_range(in, inoff, out, outoff, len - done, 0);
+	if (rc <= 0)
+	    break;
+	done += rc;
+    }
+    if (done == len || !rc)
+	return done;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+	fs_errno = FS_EOS;
+	return -1;
+    }
+    /* a pipe or socket at the output still works with sendfile */
+    while (inoff && !outoff && done < len) {
+	rc = sendfile(out, in, inoff, len - done);
+	if (rc <= 0)
+	    break;
+	done += rc;
+    }
+    if (done == len)
+	return done;
+#endif /* USE_COPY_FILE_RANGE */
+    if (done < len && !(buf = (char*)malloc(COPY_BUFSIZE))) {
+	fs_errno = FS_ENOMEM;
+	return -1;
+    }
+    while (done < len) {
+	cnt = len - done < COPY_BUFSIZE ? len - done : COPY_BUFSIZE;
+	rc = inoff ? pread(in, buf, cnt, *inoff) : read(in, buf, cnt);
+	if (rc < 0) {
+	    fs_errno = FS_EOS;
+	    return -1;
+	}
+	if (!rc)
+	    break;
+	if ((outoff ? pwrite(out, buf, rc, *outoff) : write(out, buf, rc)) != rc) {
+	    fs_errno = FS_EOS;
+	    return -1;
+	}
+	if (inoff)
+	    *inoff += rc;
+	if (outoff)
+	    *outoff += rc;
+	done += rc;
+    }
+    return done;
+}
+
+/* Empties an open file, and gives it a new chain of the given number of
+   blocks */
+static void file_realloc (FSFile *f, int blocks) {
+    block_t tail = 0;
+    FSFile *h;
+    free_file_blocks(f->first_block, f->file_size, f->sparse);
+    check_error();
+    for (h = FSState.files; h; h = h->next)
+	if (h->first_block == f->first_block) {
+	    h->sparse = 0;
+	    sparse_drop(h);
+	}
+    f->first_block = blocks ? allocate_blocks(blocks, &tail) : 0;
+    if (fs_errno)
+	f->first_block = 0;
+    f->current_block = f->first_block;
+    f->last_block = tail;
+    f->blocks = f->first_block ? blocks : 0;
+    f->seek_block = 0;
+    f->fileptr = (FSLocation) {0, 0};
+    set_file_size(f, 0);
+}
+
+int fs_import_fd (int fd, char *path) {
+    struct stat st;
+    FSFile *f;
+    block_t block, next;
+    off_t start, off;
+    int size, copied = 0, len, rc = 0;
+    scratch_block(char, buf);
+    trace_op(FSOP_IMPORT, path, &copied);
+    check_scratch_ret(buf, -1);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    if (fstat(fd, &st) < 0) {
+	fs_errno = FS_EOS;
+	return -1;
+    }
+    start = lseek(fd, 0, SEEK_CUR);
+    f = fs_open(path, 1);
+    if (!f)
+	return -1;
+    if (!S_ISREG(st.st_mode) || start < 0) {
+	/* pipes and the like have no size to allocate for up front */
+	file_realloc(f, 0);
+	while (!fs_errno && (rc = read(fd, buf, FSState.blocksize)) > 0)
+	    if (fs_write(f, buf, rc) == rc)
+		copied += rc;
+	if (rc < 0)
+	    fs_errno = FS_EOS;
+	fs_close(f);
+	return fs_errno ? -1 : copied;
+    }
+    size = st.st_size > start ? st.st_size - start : 0;
+    file_realloc(f, blk_divup(size));
+    if (fs_errno) {
+	fs_close(f);
+	return -1;
+    }
+    for (block = f->first_block; copied < size; block = next) {
+	len = chain_run(block, blk_divup(size - copied), &next) * FSState.blocksize;
+	if (fs_errno)
+	    break;
+	if (len > size - copied)
+	    len = size - copied;
+	off = (off_t)block * FSState.blocksize;
+	mcache_drop(block, blk_divup(len));
+	rc = copy_range(fd, NULL, FSState.fd, &off, len);
+	if (rc < 0)
+	    break;
+	FSState.stats.byteswritten += rc;
+	copied += rc;
+	if (rc < len)	/* the file got shorter under our feet */
+	    break;
+    }
+    set_file_size(f, copied);
+    fs_close(f);
+    return fs_errno ? -1 : copied;
+}
+
+int fs_export_fd (char *path, int fd) {
+    FSFile *f;
+    block_t block, next;
+    off_t off;
+    int copied = 0, len, rc;
+    trace_op(FSOP_EXPORT, path, &copied);
+    fs_errno = FS_NOERR;
+    flush_files();
+    check_error_ret(-1);
+    f = fs_open(path, 0);
+    if (!f)
+	return -1;
+    if (f->sparse) {
+	/* the holes are read as zeros */
+	scratch_copy(buf);
+	if (!buf) {
+	    fs_errno = FS_ENOMEM;
+	    fs_close(f);
+	    return -1;
+	}
+	while ((len = fs_read(f, buf, COPY_BUFSIZE)) > 0) {
+	    if (write(fd, buf, len) != len) {
+		fs_errno = FS_EOS;
+		break;
+	    }
+	    copied += len;
+	}
+	fs_close(f);
+	return fs_errno ? -1 : copied;
+    }
+    for (block = f->first_block; copied < f->file_size; block = next) {
+	len = chain_run(block, blk_divup(f->file_size - copied), &next) * FSState.blocksize;
+	if (fs_errno)
+	    break;
+	if (len > f->file_size - copied)
+	    len = f->file_size - copied;
+	off = (off_t)block * FSState.blocksize;
+	rc = copy_range(FSState.fd, &off, fd, NULL, len);
+	if (rc < 0)
+	    break;
+	FSState.stats.bytesread += rc;
+	copied += rc;
+	if (rc < len) {
+	    fs_errno = FS_ENOBLOCK;
+	    break;
+	}
+    }
+    fs_close(f);
+    return fs_errno ? -1 : copied;
+}
+
+/* Copies a sparse file a run of data at a time, so that the copy gets the
+   same holes */
+static void copy_sparse (FSFile *in, FSFile *out) {
+    scratch_copy(buf);
+    int pos, end, n;
+    check_scratch(buf);
+    file_realloc(out, 0);
+    check_error();
+    for (pos = 0; (pos = fs_seek_data(in, pos)) >= 0; pos = end) {
+	end = fs_seek_hole(in, pos);
+	check_error();
+	fs_seek(in, pos);
+	fs_seek(out, pos);
+	for (; pos < end; pos += n) {
+	    n = end - pos < COPY_BUFSIZE ? end - pos : COPY_BUFSIZE;
+	    if (fs_read(in, buf, n) != n || fs_write(out, buf, n) != n) {
+		if (!fs_errno)
+		    fs_errno = FS_ENOBLOCK;
+		return;
+	    }
+	}
+    }
+    if (fs_errno != FS_ENXIO)
+	return;
+    fs_errno = FS_NOERR;
+    fs_seek(out, in->file_size);
+    fs_truncate(out);
+}
+
+int fs_copy (char *src, char *dst) {
+    FSFile *in, *out;
+    block_t sblock, dblock, snext, dnext;
+    off_t soff, doff;
+    int size, copied = 0, left, srun, drun, run, len;
+    trace_op(FSOP_COPY, src, &copied);
+    trace_path2(dst);
+    fs_errno = FS_NOERR;
+    journal_begin();
+    flush_files();
+    check_error_ret(-1);
+    in = fs_open(src, 0);
+    if (!in)
+	return -1;
+    out = fs_open(dst, 1);
+    if (!out) {
+	fs_close(in);
+	return -1;
+    }
+    if (out->dirent.block == in->dirent.block && out->dirent.offset == in->dirent.offset) {
+	fs_errno = FS_EEXIST;
+	goto done;
+    }
+    size = in->file_size;
+    if (in->sparse) {
+	copy_sparse(in, out);
+	copied = fs_errno ? 0 : size;
+	goto done;
+    }
+    file_realloc(out, blk_divup(size));
+    if (fs_errno)
+	goto done;
+    sblock = in->first_block;
+    dblock = out->first_block;
+    while (copied < size) {
+	/* copy the overlap of the current source and destination extents */
+	left = blk_divup(size - copied);
+	srun = chain_run(sblock, left, &snext);
+	drun = chain_run(dblock, left, &dnext);
+	if (fs_errno)
+	    break;
+	run = srun < drun ? srun : drun;
+	len = run * FSState.blocksize;
+	if (len > size - copied)
+	    len = size - copied;
+	soff = (off_t)sblock * FSState.blocksize;
+	doff = (off_t)dblock * FSState.blocksize;
+	mcache_drop(dblock, run);
+	if (copy_range(FSState.fd, &soff, FSState.fd, &doff, len) != len) {
+	    if (!fs_errno)
+		fs_errno = FS_ENOBLOCK;
+	    break;
+	}
+	FSState.stats.bytesread += len;
+	FSState.stats.byteswritten += len;
+	copied += len;
+	sblock = run == srun ? snext : sblock + run;
+	dblock = run == drun ? dnext : dblock + run;
+    }
+    set_file_size(out, copied);
+done:
+    fs_close(out);
+    fs_close(in);
+    return fs_errno ? -1 : copied;
+}
+
+/* fs_walk works on a snapshot of the FAT, and reads directories with
+   pread into buffers of its own, so the workers share nothing but the
+   queues below. Each worker takes directories from the end of its own
+   queue, where it adds the subdirectories it finds, and steals from the
+   start of the queues of the others when its own is empty. */
+typedef struct {
+    block_t block;
+    char *path;
+} FSWalkJob;
+
+typedef struct {
+    FSWalkJob *jobs;
+    int head, tail, size;
+#if USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+} FSWalkQueue;
+
+typedef struct {
+    FSWalkFunc visitor;
+    void *arg;
+    block_t *fat;
+    FSWalkQueue *queues;
+    int nthreads;
+    int queued, pending;	/* directories in the queues, and not done yet */
+    int error, stop;
+#if USE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} FSWalk;
+
+typedef struct {
+    FSWalk *w;
+    int id;
+} FSWalkWorker;
+
+/* the directory a worker is walking */
+typedef struct {
+    FSWalk *w;
+    int id;
+    char *path;
+} FSWalkDir;
+
+#if USE_PTHREADS
+#define walk_lock(m)	pthread_mutex_lock(m)
+#define walk_unlock(m)	pthread_mutex_unlock(m)
+#else
+#define walk_lock(m)
+#define walk_unlock(m)
+#endif
+
+/* stop is set under the lock, and polled without it */
+#define walk_stopped(w)	__atomic_load_n(&(w)->stop, __ATOMIC_RELAXED)
+
+/* ends the walk, keeping the first error */
+static void walk_fail (FSWalk *w, int error) {
+    walk_lock(&w->lock);
+    if (!w->stop)
+	w->error = error;
+    w->stop = 1;
+#if USE_PTHREADS
+    pthread_cond_broadcast(&w->cond);
+#endif
+    walk_unlock(&w->lock);
+}
+
+static void walk_push (FSWalk *w, int id, block_t block, char *path) {
+    FSWalkQueue *q = &w->queues[id];
+    FSWalkJob *jobs;
+    char *copy = strdup(path);
+    walk_lock(&q->lock);
+    if (copy && q->tail == q->size) {
+	jobs = (FSWalkJob*)realloc(q->jobs, (q->size ? q->size * 2 : 64) * sizeof(FSWalkJob));
+	if (jobs) {
+	    q->jobs = jobs;
+	    q->size = q->size ? q->size * 2 : 64;
+	}
+    }
+    if (!copy || q->tail == q->size) {
+	walk_unlock(&q->lock);
+	free(copy);
+	walk_fail(w, FS_ENOMEM);
+	return;
+    }
+    q->jobs[q->tail].block = block;
+    q->jobs[q->tail++].path = copy;
+    walk_unlock(&q->lock);
+    walk_lock(&w->lock);
+    w->queued++;
+    w->pending++;
+#if USE_PTHREADS
+    pthread_cond_signal(&w->cond);
+#endif
+    walk_unlock(&w->lock);
+}
+
+/* takes the newest job of queue id, or the oldest if stealing */
+static int walk_take (FSWalk *w, int id, int steal, FSWalkJob *job) {
+    FSWalkQueue *q = &w->queues[id];
+    int found = 0;
+    walk_lock(&q->lock);
+    if (q->tail > q->head) {
+	*job = steal ? q->jobs[q->head++] : q->jobs[--q->tail];
+	if (q->head == q->tail)
+	    q->head = q->tail = 0;
+	found = 1;
+    }
+    walk_unlock(&q->lock);
+    if (found) {
+	walk_lock(&w->lock);
+	w->queued--;
+	walk_unlock(&w->lock);
+    }
+    return found;
+}
+
+/* Calls the visitor for an entry of the directory at path, and queues it
+   to be walked if it's a directory the visitor didn't prune */
+static void walk_entry (FSFileInfo *fi, void *arg) {
+    FSWalkDir *d = (FSWalkDir*)arg;
+    FSWalk *w = d->w;
+    FSDirEntryOut e;
+    char sub[strlen(d->path) + 258];
+    int rc;
+    if (walk_stopped(w))
+	return;
+    e.attrs = fi->attrs;
+    e.size = fi->size;
+    e.firstblk = fi->firstblk;
+    strcpy(e.name, fi->fname);
+    sprintf(sub, "%s/%s", d->path, fi->fname);
+    rc = w->visitor(sub, &e, w->arg);
+    if (rc == FS_WALK_STOP)
+	walk_fail(w, -1);
+    else if (rc != FS_WALK_PRUNE && (e.attrs & FATTR_DIRECTORY) && e.firstblk)
+	walk_push(w, d->id, e.firstblk, sub);
+}
+
+static void walk_dir (FSWalk *w, int id, FSWalkJob *job, char *blockdata) {
+    FSWalkDir d = {w, id, job->path};
+    FSDirSearchInfo dsinfo;
+    FSFileInfo fi;
+    char name[256];
+    block_t block;
+    int hops = 0;
+    dir_entries_init(&dsinfo, &fi);
+    for (block = job->block; block && !walk_stopped(w); block = w->fat[block]) {
+	if (block >= FSState.maxblocks || ++hops > FSState.maxblocks) {
+	    walk_fail(w, FS_ENOBLOCK);
+	    return;
+	}
+	if (pread(FSState.fd, blockdata, FSState.blocksize,
+		  (off_t)block * FSState.blocksize) != FSState.blocksize) {
+	    walk_fail(w, FS_EOS);
+	    return;
+	}
+	if (dir_entries(blockdata, block, job->block, &dsinfo, &fi, name, walk_entry, &d))
+	    return;
+    }
+}
+
+static void *walk_worker (void *arg) {
+    FSWalkWorker *worker = (FSWalkWorker*)arg;
+    FSWalk *w = worker->w;
+    FSWalkJob job;
+    char *blockdata = (char*)malloc(FSState.blocksize);
+    int i, found, done;
+    if (!blockdata) {
+	walk_fail(w, FS_ENOMEM);
+	return NULL;
+    }
+    while (1) {
+	found = walk_take(w, worker->id, 0, &job);
+	for (i = 1; !found && i < w->nthreads; i++)
+	    found = walk_take(w, (worker->id + i) % w->nthreads, 1, &job);
+	if (found) {
+	    if (!walk_stopped(w))
+		walk_dir(w, worker->id, &job, blockdata);
+	    free(job.path);
+	    walk_lock(&w->lock);
+#if USE_PTHREADS
+	    if (!--w->pending)
+		pthread_cond_broadcast(&w->cond);
+#else
+	    w->pending--;
+#endif
+	    walk_unlock(&w->lock);
+	    continue;
+	}
+	walk_lock(&w->lock);
+#if USE_PTHREADS
+	while (!w->queued && w->pending && !w->stop)
+	    pthread_cond_wait(&w->cond, &w->lock);
+#endif
+	done = !w->pending || (w->stop && !w->queued);
+	walk_unlock(&w->lock);
+	if (done)
+	    break;
+    }
+    free(blockdata);
+    return NULL;
+}
+
+/* Walks the tree under root with nthreads workers (APFS_WALK_THREADS if 0).
+   The visitor is called from the workers, concurrently when nthreads is
+   above 1, and must not change the filesystem. Returns 0 once the whole
+   tree was walked, 1 if the visitor stopped the walk, and -1 on error. */
+int fs_walk (char *root, FSWalkFunc visitor, void *arg, int nthreads) {
+    FSWalk w;
+    FSWalkWorker *workers = NULL;
+    FSFileInfo *fi;
+    char path[strlen(root) + 1];
+    int i, len, fatbytes;
+#if USE_PTHREADS
+    pthread_t *threads = NULL;
+    int started = 1;
+#endif
+    trace_op(FSOP_WALK, root, NULL);
+    fs_errno = FS_NOERR;
+    flush_files();
+    check_error_ret(-1);
+    fi = get_file_info(root);
+    check_error_ret(-1);
+    if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
+	fs_errno = FS_ENOTDIR;
+	return -1;
+    }
+    /* the workers read the image directly, so it must be up to date */
+    journal_flush();
+    check_error_ret(-1);
+#if !USE_PTHREADS
+    nthreads = 1;
+#endif
+    if (nthreads < 1)
+	nthreads = APFS_WALK_THREADS;
+    memset(&w, 0, sizeof(w));
+    w.visitor = visitor;
+    w.arg = arg;
+    w.nthreads = nthreads;
+    fatbytes = FSState.maxblocks * sizeof(block_t) + sizeof(FSInfoBlock);
+    w.fat = (block_t*)malloc(fatbytes);
+    w.queues = (FSWalkQueue*)calloc(nthreads, sizeof(FSWalkQueue));
+    workers = (FSWalkWorker*)malloc(nthreads * sizeof(FSWalkWorker));
+#if USE_PTHREADS
+    threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    if (!threads)
+	goto nomem;
+#endif
+    if (!w.fat || !w.queues || !workers)
+	goto nomem;
+    if (pread(FSState.fd, w.fat, fatbytes, 0) != fatbytes) {
+	fs_errno = FS_EOS;
+	goto out;
+    }
+    w.fat += sizeof(FSInfoBlock) / sizeof(block_t);
+#if USE_PTHREADS
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    for (i = 0; i < nthreads; i++)
+	pthread_mutex_init(&w.queues[i].lock, NULL);
+#endif
+    strcpy(path, root);
+    for (len = strlen(path); len && path[len - 1] == '/'; len--)
+	path[len - 1] = 0;
+    if (fi->firstblk)
+	walk_push(&w, 0, fi->firstblk, path);
+    for (i = 0; i < nthreads; i++) {
+	workers[i].w = &w;
+	workers[i].id = i;
+    }
+#if USE_PTHREADS
+    for (; started < nthreads; started++)
+	if (pthread_create(&threads[started], NULL, walk_worker, &workers[started]))
+	    break;
+#endif
+    walk_worker(&workers[0]);
+#if USE_PTHREADS
+    for (i = 1; i < started; i++)
+	pthread_join(threads[i], NULL);
+    for (i = 0; i < nthreads; i++) {
+	while (w.queues[i].tail > w.queues[i].head)
+	    free(w.queues[i].jobs[--w.queues[i].tail].path);
+	pthread_mutex_destroy(&w.queues[i].lock);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+#endif
+    w.fat -= sizeof(FSInfoBlock) / sizeof(block_t);
+    if (w.error > 0)
+	fs_errno = w.error;
+    goto out;
+nomem:
+    fs_errno = FS_ENOMEM;
+out:
+    for (i = 0; w.queues && i < nthreads; i++)
+	free(w.queues[i].jobs);
+    free(w.queues);
+    free(w.fat);
+    free(workers);
+#if USE_PTHREADS
+    free(threads);
+#endif
+    if (fs_errno)
+	return -1;
+    return w.stop ? 1 : 0;
+}
@@ -8,13 +8,39 @@ typedef struct { /* total of 16 bytes */
     block_t blocksize; /* in bytes */
     block_t maxblocks; /* maximum blocks in file system */
     block_t freeblocks; /* how many free blocks are in the file system */
-    char reserved[4];
+    block_t journal; /* blocks in the metadata journal */
+    block_t orphans; /* first of the chains waiting to be freed */
 } FSInfoBlock;
 
+/* The metadata journal takes the blocks following the root directory. Its
+   first block holds this header, followed by the home location of each of
+   the logged blocks, which come next. */
+typedef struct {
+    unsigned int sig;
+    unsigned int sum; /* of the header and the logged blocks */
+    block_t count;
+    block_t reserved;
+} FSJournalHeader;
+
+/* A sparse file only has blocks for the parts of it which were written.
+   Its chain starts with a map of them: this header, followed by the runs
+   of blocks the file has, in order, whose blocks are the rest of the chain.
+   Whatever lies outside the runs is a hole, and reads as zeros. */
+typedef struct {
+    unsigned int runs;
+    unsigned int blocks; /* in the chain, the map included */
+} FSSparseHeader;
+
+typedef struct {
+    unsigned int start, count; /* in blocks of the file */
+} FSSparseRun;
+
 #define FATTR_FILE	0x1
 #define FATTR_NAMECHUNK	0x2
 #define FATTR_LASTCHUNK 0x4
 #define FATTR_DIRECTORY 0x8
+#define FATTR_SPARSE	0x10	/* the file has holes, see FSSparseHeader */
+#define FATTR_HEADER	0x20	/* directory header record (version 2) */
 #define FATTR_READONLY	0x40
 #define FATTR_DELETED	0x80
 
@@ -25,6 +51,38 @@ typedef struct {
     unsigned int size;  /* byte 5 - 8 */
 } FSDirEntry;
 
+/* Version 2 directories are made of variable length records, which never
+   cross a block boundary. The first record of every directory is a header
+   record (FATTR_HEADER, no name). For indexed directories its firstblk is
+   the root node of the directory index, and size the last block of the
+   directory; both are 0 otherwise. */
+typedef struct { /* total of 12 bytes, followed by the name */
+    unsigned char attrs;
+    unsigned char namelen;
+    unsigned short reclen; /* bytes up to the next record in the block */
+    unsigned int size;
+    block_t firstblk;
+    unsigned short hash; /* name_hash() of the name */
+} FSDirRecord;
+
+/* Directory index: a B+tree of name hashes, with the directory block holding
+   the record in the leaves. Each node takes one block, and starts with an
+   FSIndexNode followed by count FSIndexEntry, sorted by hash. In internal
+   nodes, block is a child node whose hashes are not below hash; lookups
+   start at the last child below the hash, and go on along the leaves. */
+typedef struct { /* total of 8 bytes */
+    unsigned short level; /* 0 for leaves */
+    unsigned short count;
+    block_t next; /* next leaf */
+    unsigned short reserved;
+} FSIndexNode;
+
+typedef struct {
+    unsigned short hash;
+    block_t block;
+} FSIndexEntry;
+
+/* version 1 entries: offset is a slot index, version 2: a byte offset */
 typedef struct {
     block_t block, offset;
 } FSLocation;
@@ -34,59 +92,195 @@ typedef struct {
     char *fname;
     unsigned int size;
     block_t firstblk;
+    block_t dir; /* first block of the containing directory */
     FSLocation dirent;
 } FSFileInfo;
 
 /* physical block numbers: first_block, current_block
    logical block numbers: seek_block, fileptr.block */
-typedef struct {
+typedef struct FSFile {
     int file_size;
     FSLocation fileptr, dirent;
-    block_t first_block, current_block, seek_block;
+    block_t first_block, current_block, seek_block, dir;
+    block_t last_block; /* tail of the chain, if blocks isn't -1 */
+    int blocks;
+    unsigned short id; /* number of the handle in recorded traces */
+    int ra_pos; /* where the last read ended */
+    int ra_window; /* blocks to read ahead, 0 if reading isn't sequential */
+    block_t ra_block, ra_phys; /* logical and physical block readahead got to */
+    char *wbuf; /* partly written block, not on the disk yet if wdirty */
+    block_t wblock; /* physical block in wbuf, 0 if none */
+    char wdirty, sizedirty; /* file_size isn't in the directory entry yet */
+    char *dbuf; /* data written past the end of the chain, see file_delay */
+    int dstart, dlen, dsize; /* its offset in the file, length, and room */
+    char sparse; /* FATTR_SPARSE */
+    struct FSBlockMap *map; /* the map of a sparse file, once it's read */
+    struct FSFile *next; /* list of open files */
 } FSFile;
 
 typedef struct {
     int totalblocks, freeblocks, blocksize;
 } FSInfo;
 
+typedef struct {
+    int files, fragmented;	/* files, and how many of them are fragmented */
+    int extents, blocks;	/* contiguous runs of blocks in files */
+    int freeextents;		/* contiguous runs in the free list */
+} FSFragInfo;
+
+/* counters of the work done since the filesystem was opened, or since the
+   last fs_resetstats */
+typedef struct {
+    unsigned long reads, writes;	/* blocks read from and written to the image */
+    unsigned long long bytesread, byteswritten;
+    unsigned long journalhits;		/* metadata reads served by the journal */
+    unsigned long commits, commitblocks; /* journal transactions, and their size */
+    unsigned long fathits, fatmisses;	/* FAT accesses to the cached block, or not */
+    unsigned long fatwritebacks;	/* modified FAT blocks written back */
+    unsigned long lookups, lookupblocks; /* name lookups, and directory blocks read */
+    unsigned long seeks, seekhops;	/* seeks which walked a chain, and FAT entries followed */
+    unsigned long allocs, allocblocks;	/* allocation requests, and blocks allocated */
+    unsigned long readahead;		/* blocks hinted to be read ahead */
+    unsigned long preloaded, preloadhits; /* metadata blocks read at mount, and reads they served */
+} FSStats;
+
 typedef struct {
     int nameptr;
     char name[256];
     FSLocation dirent;
     FSDirEntry *cache;
+    block_t dir;
+    int live, deleted, blocks; /* seen so far */
 } FSDirSearchInfo;
 
+/* an entry returned by fs_readdir_batch */
+typedef struct {
+    char attrs;
+    unsigned int size;
+    block_t firstblk;
+    char name[256];
+} FSDirEntryOut;
+
+/* Called by fs_walk for every entry below the root, with its path. It may
+   return FS_WALK_PRUNE to skip the contents of a directory, or FS_WALK_STOP
+   to end the walk */
+typedef int (*FSWalkFunc)(char *path, FSDirEntryOut *entry, void *arg);
+
+#define FS_WALK_CONTINUE	0
+#define FS_WALK_PRUNE		1
+#define FS_WALK_STOP		2
+
+/* operations timed when APFS_TRACE is set */
+#define FSOP_OPEN	0
+#define FSOP_CLOSE	1
+#define FSOP_READ	2
+#define FSOP_WRITE	3
+#define FSOP_TRUNCATE	4
+#define FSOP_MKDIR	5
+#define FSOP_RMDIR	6
+#define FSOP_DELTREE	7
+#define FSOP_FINDFIRST	8
+#define FSOP_FINDNEXT	9
+#define FSOP_REMOVE	10
+#define FSOP_MOVE	11
+#define FSOP_RENAME	12
+#define FSOP_COPY	13
+#define FSOP_IMPORT	14
+#define FSOP_EXPORT	15
+#define FSOP_DEFRAG	16
+#define FSOP_COMPACTDIR	17
+#define FSOP_FLUSH	18
+#define FSOP_FSYNC	19
+#define FSOP_WALK	20
+#define FSOP_COUNT	21
+
+/* Latencies, in nanoseconds, counted in buckets which are exact below
+   FS_HIST_SUB, and then split every power of two in FS_HIST_SUB buckets, so
+   a value is never off by more than 1/FS_HIST_SUB */
+#define FS_HIST_SUB	16
+#define FS_HIST_BUCKETS	(60 * FS_HIST_SUB)
+
+typedef struct {
+    unsigned long count;
+    unsigned long long total, max;
+    unsigned long buckets[FS_HIST_BUCKETS];
+} FSHistogram;
+
+typedef void (*FSTraceFunc)(int op, char *path, int bytes, unsigned long long ns);
+
+/* A trace written by fs_record starts with FS_TRACE_MAGIC, followed by a
+   record per call, each followed by its paths (not NUL terminated) */
+#define FS_TRACE_MAGIC	"APFSTRC1"
+
+typedef struct {
+    unsigned long long start;	/* nanoseconds since the recording started */
+    unsigned int ns;		/* time the call took */
+    int offset;			/* position in the open file the call started at */
+    int count;			/* bytes asked for, or the create flag of fs_open */
+    int result;			/* bytes moved, or -1 if the call failed */
+    unsigned char op;		/* FSOP_* */
+    unsigned char reserved;
+    unsigned short handle;	/* FSFile id of the open file, or 0 */
+    unsigned short pathlen, path2len;
+} FSTraceRecord;
+
 /* fs image manipulation functions */
 extern int create_fs (char *, unsigned int);
 extern int create_fsex (char *fname, block_t, block_t);
 extern int open_fs (char *);
+extern int open_fsex (char *fname, long preload);
 extern void close_fs (void);
 extern void fs_flush (void);
 extern FSInfo *fs_info (void);
+extern int fs_fraginfo (char *path, FSFragInfo *);
+extern int fs_defrag (char *path);
+extern void fs_stats (FSStats *);
+extern void fs_resetstats (void);
+extern FSHistogram *fs_latency (int op);
+extern unsigned long long fs_percentile (FSHistogram *, double p);
+extern void fs_resetlatency (void);
+extern void fs_settrace (FSTraceFunc);
+extern int fs_record (char *fname);
+extern char *fs_opname (int op);
 
 /* directory functions */
 extern int fs_mkdir (char *path);
 extern int fs_rmdir (char *path);
+extern int fs_deltree (char *path);
 extern FSFileInfo *fs_findfirst (char *, FSDirSearchInfo *);
 extern FSFileInfo *fs_findnext (FSDirSearchInfo *);
 extern void fs_findend (FSDirSearchInfo *);
+extern int fs_opendir (char *, FSDirSearchInfo *);
+extern int fs_readdir_batch (FSDirSearchInfo *, FSDirEntryOut *, int);
+extern int fs_walk (char *root, FSWalkFunc visitor, void *arg, int nthreads);
+extern int fs_compactdir (char *path);
 
 /* functions to access files on the filesystem */
 extern FSFile *fs_open (char*, int);	/* open/create a file */
-#if USE_FUNOPEN
+#if USE_FUNOPEN || USE_FOPENCOOKIE
 extern FILE *fs_fopen (char *, char *);
-#endif /* USE_FUNOPEN */
+#endif /* USE_FUNOPEN || USE_FOPENCOOKIE */
 extern int fs_close (FSFile *f);
 extern int fs_read (FSFile *f, void *buf, int count);
 extern int fs_write (FSFile *f, void *buf, int count);
 extern int fs_seek (FSFile *f, int offset);
 extern int fs_lseek (FSFile *f, int offset, int whence);
 extern int fs_tell (FSFile *f);
+extern int fs_seek_data (FSFile *f, int offset);
+extern int fs_seek_hole (FSFile *f, int offset);
 extern int fs_truncate (FSFile *);
+extern int fs_fsync (FSFile *f);
 extern int fs_getfilesize (FSFile *);
 extern void fs_removefi (FSFileInfo *);	/* delete a file specified by FSFileInfo */
 extern int fs_remove (char *);		/* delete a file by its name */
 extern void fs_removef (FSFile *f);	/* delete an open file */
+extern int fs_move (char *name, char *newpath);	/* move a file or directory */
+extern int fs_rename (char *name, char *newname); /* rename in place */
+extern int fs_movef (FSFile *f, char *newpath);	/* move an open file */
+extern int fs_renamef (FSFile *f, char *newname);
+extern int fs_import_fd (int fd, char *path);	/* copy a host file in */
+extern int fs_export_fd (char *path, int fd);	/* copy a file out to the host */
+extern int fs_copy (char *src, char *dst);	/* copy a file within the image */
 
 /* fs_errno interface */
 extern int fs_errno;
@@ -98,7 +292,7 @@ extern void fs_perror(char *str);
 #define FS_ENOTDIR	3	/* File is not a directory */
 #define FS_EISDIR	4	/* Attempt to open/remove a directory */
 #define FS_ENOSPACE	5	/* Out of space while allocating a block */
-#define FS_ENAMETOOLONG	6	/* File name exceeded 252 chars */
+#define FS_ENAMETOOLONG	6	/* File name exceeded 252 (255 in v2) chars */
 #define FS_ENOBLOCK	7	/* Specified block number is out of range */
 #define FS_EEXIST	8	/* File already exists */
 #define FS_EFORMAT	9	/* Invalid filesystem format */
@@ -106,3 +300,4 @@ extern void fs_perror(char *str);
 #define FS_ENOTEMPTY	11	/* Directory not empty */
 #define FS_ENOMEM	12	/* Out of memory */
 #define FS_ENOPERM	13	/* Operation not permitted */
+#define FS_ENXIO	14	/* No data past the offset */
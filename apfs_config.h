@@ -1 +1,80 @@
+/* fs_fopen wraps files in stdio streams, with funopen on the BSDs, and with
+   fopencookie on Linux */
+#ifdef __linux__
+#define USE_FUNOPEN 0
+#define USE_FOPENCOOKIE 1
+#else
 #define USE_FUNOPEN 1
+#define USE_FOPENCOOKIE 0
+#endif
+
+/* stdio buffer of the streams fs_fopen opens with fopencookie, in bytes.
+   Every refill or flush of the buffer is a single fs_read or fs_write, so a
+   bigger buffer, here or given with setvbuf, means fewer and larger reads
+   of the image. 0 keeps the stdio default */
+#define APFS_FOPEN_BUFSIZE 65536
+
+/* fs_import_fd, fs_export_fd and fs_copy move data inside the kernel with
+   copy_file_range and sendfile, which are Linux specific */
+#ifdef __linux__
+#define USE_COPY_FILE_RANGE 1
+#else
+#define USE_COPY_FILE_RANGE 0
+#endif
+
+/* version 1 directory blocks are scanned with SSE2, and with AVX2 where the
+   processor has it, 64 entries at a time. 0 scans them without */
+#if defined(__GNUC__) && defined(__SSE2__)
+#define USE_SIMD 1
+#else
+#define USE_SIMD 0
+#endif
+
+/* version 2 directories longer than this many blocks get a hash index */
+#define APFS_DIRINDEX_BLOCKS 8
+
+/* directories found to be more than this percent deleted entries, when
+   scanned through, get compacted */
+#define APFS_COMPACT_RATIO 50
+
+/* most blocks to read ahead of files read sequentially. The window starts
+   at 4 blocks, and doubles every time the reader catches up with half of
+   it. 0 disables readahead */
+#define APFS_READAHEAD_BLOCKS 64
+
+/* open_fs reads the FAT and the directories into memory, in a few large
+   reads, up to this many bytes of them, so the first operations after
+   mounting don't wait for the disk. open_fsex takes another budget. 0
+   disables preloading */
+#define APFS_PRELOAD_BYTES 4194304
+
+/* format_fs writes only the first few FAT blocks, and leaves the entries of
+   the data blocks to be written as they are first allocated, so formatting
+   takes the same time whatever the size of the filesystem. Versions of the
+   library older than this option find the free list of such filesystems
+   cut short. 0 writes the whole FAT */
+#define APFS_LAZY_FAT 1
+
+/* data appended to a file is kept in memory, up to this many bytes per
+   handle, and gets its blocks when the handle is flushed or closed, in a
+   single allocation. 0 allocates blocks as the data is written */
+#define APFS_DELALLOC_BYTES 1048576
+
+/* size of the metadata journal of new filesystems, in blocks. FAT and
+   directory updates are kept in memory until the journal is half full, or
+   until fs_flush, and are then committed together. 0 disables the journal */
+#define APFS_JOURNAL_BLOCKS 64
+
+/* times every fs_* call which works on the filesystem into a latency
+   histogram per operation (see fs_latency), and passes it to the function
+   set with fs_settrace. 0 compiles all of it away */
+#define APFS_TRACE 0
+
+/* fs_walk spreads the tree over this many threads when it is given 0, and
+   runs in the calling thread only if USE_PTHREADS is 0 */
+#define USE_PTHREADS 1
+#define APFS_WALK_THREADS 4
+
+/* fs_open takes its handles from a pool of closed ones, and fills the pool
+   this many handles at a time */
+#define APFS_FILE_SLAB 64
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "apfs.h"
+
+#define MAXSAMPLES	1000000
+
+static char *image = "apfs-bench.fs";
+static int scale = 1, csv = 0, results = 0, mounted = 0;
+static char buf[1 << 20];
+
+/* the workload being measured */
+static char name[64];
+static double start, *samples;
+static int ops, nsamples;
+static long long bytes;
+
+static double now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail (char *what) {
+    fs_perror(what);
+    if (mounted)
+	close_fs();
+    unlink(image);
+    exit(1);
+}
+
+static void fresh (int blocksize, int blocks) {
+    if (mounted)
+	close_fs();
+    mounted = !create_fsex(image, blocksize, blocks);
+    if (!mounted)
+	fail("create_fsex");
+}
+
+static void begin (char *fmt, int arg1, int arg2) {
+    snprintf(name, sizeof(name), fmt, arg1, arg2);
+    ops = nsamples = 0;
+    bytes = 0;
+    start = now();
+}
+
+/* records an operation which took us microseconds, and moved count bytes */
+static void record (double us, int count) {
+    if (nsamples < MAXSAMPLES)
+	samples[nsamples++] = us;
+    ops++;
+    bytes += count;
+}
+
+/* records an operation which started at t, and moved count bytes */
+static void sample (double t, int count) {
+    record((now() - t) * 1e6, count);
+}
+
+static int cmp_double (const void *a, const void *b) {
+    double x = *(double*)a, y = *(double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile (double p) {
+    int i = p * nsamples;
+    if (!nsamples)
+	return 0;
+    return samples[i < nsamples ? i : nsamples - 1];
+}
+
+static void end () {
+    double total = now() - start;
+    qsort(samples, nsamples, sizeof(double), cmp_double);
+    if (csv) {
+	if (!results)
+	    printf("name,ops,seconds,ops_per_sec,mb_per_sec,"
+		   "p50_us,p90_us,p99_us,p999_us,max_us\n");
+	printf("%s,%d,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+	       name, ops, total, ops / total, bytes / total / 1048576,
+	       percentile(0.5), percentile(0.9), percentile(0.99),
+	       percentile(0.999), percentile(1));
+    } else {
+	printf("%s\n  {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, "
+	       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+	       "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+	       "\"p999_us\": %.2f, \"max_us\": %.2f}",
+	       results ? "," : "[", name, ops, total, ops / total,
+	       bytes / total / 1048576, percentile(0.5), percentile(0.9),
+	       percentile(0.99), percentile(0.999), percentile(1));
+    }
+    fflush(stdout);
+    results++;
+}
+
+/* sequential write and read of one big file, iosize bytes at a time */
+static void bench_seq (int blocksize, int blocks, int size, int iosize) {
+    FSFile *f;
+    double t;
+    int done;
+    fresh(blocksize, blocks);
+    begin("seqwrite-bs%d-io%d", blocksize, iosize);
+    f = fs_open("seq", 1);
+    if (!f)
+	fail("fs_open");
+    for (done = 0; done < size; done += iosize) {
+	t = now();
+	if (fs_write(f, buf, iosize) != iosize)
+	    fail("fs_write");
+	sample(t, iosize);
+    }
+    fs_close(f);
+    fs_flush();
+    end();
+    begin("seqread-bs%d-io%d", blocksize, iosize);
+    f = fs_open("seq", 0);
+    if (!f)
+	fail("fs_open");
+    for (done = 0; done < size; done += iosize) {
+	t = now();
+	if (fs_read(f, buf, iosize) != iosize)
+	    fail("fs_read");
+	sample(t, iosize);
+    }
+    fs_close(f);
+    end();
+}
+
+/* 4KB reads at random offsets of the file written by bench_seq */
+static void bench_random (int size, int count) {
+    FSFile *f;
+    double t;
+    int i;
+    f = fs_open("seq", 0);
+    if (!f)
+	fail("fs_open");
+    begin("randread-io%d-n%d", 4096, count);
+    for (i = 0; i < count; i++) {
+	t = now();
+	fs_seek(f, (rand() % (size / 4096)) * 4096);
+	if (fs_read(f, buf, 4096) != 4096)
+	    fail("fs_read");
+	sample(t, 4096);
+    }
+    end();
+    fs_close(f);
+}
+
+/* creates, looks up and deletes many small files in one directory */
+static void bench_storm (int count) {
+    FSFile *f;
+    char path[32];
+    double t;
+    int i, *order = malloc(count * sizeof(int));
+    fresh(1024, 60000);
+    if (fs_mkdir("/storm"))
+	fail("fs_mkdir");
+    begin("create-n%d", count, 0);
+    for (i = 0; i < count; i++) {
+	sprintf(path, "/storm/f%06d", i);
+	t = now();
+	f = fs_open(path, 1);
+	if (!f || fs_write(f, buf, 100) != 100)
+	    fail("fs_open");
+	fs_close(f);
+	sample(t, 100);
+    }
+    fs_flush();
+    end();
+    for (i = 0; i < count; i++)
+	order[i] = i;
+    for (i = count - 1; i > 0; i--) {
+	int j = rand() % (i + 1), tmp = order[i];
+	order[i] = order[j];
+	order[j] = tmp;
+    }
+    begin("lookup-n%d", count, 0);
+    for (i = 0; i < count; i++) {
+	sprintf(path, "/storm/f%06d", order[i]);
+	t = now();
+	f = fs_open(path, 0);
+	if (!f)
+	    fail("fs_open");
+	fs_close(f);
+	sample(t, 0);
+    }
+    end();
+    begin("delete-n%d", count, 0);
+    for (i = 0; i < count; i++) {
+	sprintf(path, "/storm/f%06d", order[i]);
+	t = now();
+	if (fs_remove(path))
+	    fail("fs_remove");
+	sample(t, 0);
+    }
+    fs_flush();
+    end();
+    free(order);
+}
+
+/* opens a file at the bottom of a deep directory tree */
+static void bench_deep (int depth, int count) {
+    FSFile *f;
+    char path[1024];
+    double t;
+    int i, len = 0;
+    fresh(1024, 8000);
+    for (i = 0; i < depth; i++) {
+	len += sprintf(path + len, "/dir%02d", i);
+	if (fs_mkdir(path))
+	    fail("fs_mkdir");
+    }
+    strcpy(path + len, "/file");
+    f = fs_open(path, 1);
+    if (!f)
+	fail("fs_open");
+    fs_close(f);
+    begin("deepopen-d%d-n%d", depth, count);
+    for (i = 0; i < count; i++) {
+	t = now();
+	f = fs_open(path, 0);
+	if (!f)
+	    fail("fs_open");
+	fs_close(f);
+	sample(t, 0);
+    }
+    end();
+}
+
+/* lists a directory with many entries, one at a time and in batches */
+static void bench_list (int entries, int count) {
+    static FSDirEntryOut batch[256];
+    FSDirSearchInfo dsinfo;
+    FSFileInfo *fi;
+    FSFile *f;
+    char path[32];
+    double t;
+    int i, n, rc;
+    fresh(1024, 60000);
+    if (fs_mkdir("/list"))
+	fail("fs_mkdir");
+    for (i = 0; i < entries; i++) {
+	sprintf(path, "/list/entry%06d", i);
+	f = fs_open(path, 1);
+	if (!f)
+	    fail("fs_open");
+	fs_close(f);
+    }
+    fs_flush();
+    begin("listdir-n%d", entries, 0);
+    for (i = 0; i < count; i++) {
+	t = now();
+	for (n = 0, fi = fs_findfirst("/list", &dsinfo); fi; fi = fs_findnext(&dsinfo))
+	    n++;
+	fs_findend(&dsinfo);
+	if (n != entries)
+	    fail("fs_findnext");
+	sample(t, 0);
+    }
+    end();
+    begin("listbatch-n%d", entries, 0);
+    for (i = 0; i < count; i++) {
+	t = now();
+	if (fs_opendir("/list", &dsinfo))
+	    fail("fs_opendir");
+	for (n = 0; (rc = fs_readdir_batch(&dsinfo, batch, 256)) > 0; n += rc)
+	    ;
+	if (rc < 0 || n != entries)
+	    fail("fs_readdir_batch");
+	sample(t, 0);
+    }
+    end();
+}
+
+/* deletes a file taking most of the filesystem, and times the flush which
+   follows apart */
+static void bench_huge (int size, int count) {
+    FSFile *f;
+    double t, spent = 0, *flushes = malloc(count * sizeof(double));
+    int i, done;
+    fresh(4096, 65000);
+    begin("hugedelete-mb%d", size >> 20, 0);
+    for (i = 0; i < count; i++) {
+	f = fs_open("huge", 1);
+	if (!f)
+	    fail("fs_open");
+	for (done = 0; done < size; done += sizeof(buf))
+	    if (fs_write(f, buf, sizeof(buf)) != sizeof(buf))
+		fail("fs_write");
+	fs_close(f);
+	fs_flush();
+	t = now();
+	if (fs_remove("huge"))
+	    fail("fs_remove");
+	sample(t, 0);
+	t = now();
+	fs_flush();
+	flushes[i] = (now() - t) * 1e6;
+	spent += flushes[i] / 1e6;
+    }
+    end();
+    begin("hugeflush-mb%d", size >> 20, 0);
+    for (i = 0; i < count; i++)
+	record(flushes[i], 0);
+    /* the rate is that of the flushes alone */
+    start = now() - spent;
+    end();
+    free(flushes);
+}
+
+int main (int argc, char *argv[]) {
+    static int iosizes[] = {4096, 65536, 1048576};
+    int c, i, seed = 1;
+    while ((c = getopt(argc, argv, "f:i:n:s:")) != -1)
+	switch (c) {
+	    case 'f':
+		csv = !strcmp(optarg, "csv");
+		break;
+	    case 'i':
+		image = optarg;
+		break;
+	    case 'n':
+		scale = atoi(optarg);
+		break;
+	    case 's':
+		seed = atoi(optarg);
+		break;
+	    default:
+		fprintf(stderr, "usage: %s [-f json|csv] [-i image] [-n scale] [-s seed]\n", argv[0]);
+		return 1;
+	}
+    if (scale < 1 || scale > 3) {
+	fprintf(stderr, "%s: scale must be 1 to 3\n", argv[0]);
+	return 1;
+    }
+    samples = malloc(MAXSAMPLES * sizeof(double));
+    if (!samples) {
+	perror("malloc");
+	return 1;
+    }
+    srand(seed);
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = rand();
+    for (i = 0; i < 3; i++)
+	bench_seq(512, 40000, 16 << 20, iosizes[i]);
+    for (i = 0; i < 3; i++)
+	bench_seq(4096, 65000, (64 << 20) * scale, iosizes[i]);
+    bench_random((64 << 20) * scale, 20000 * scale);
+    bench_storm(5000 * scale);
+    bench_deep(32, 20000 * scale);
+    bench_list(10000 * scale, 20);
+    bench_huge((64 << 20) * scale, 3);
+    if (mounted)
+	close_fs();
+    unlink(image);
+    if (!csv)
+	printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include "apfs.h"
+
+void report (char *when, FSFragInfo *fi) {
+    printf("%s: %d files, %d fragmented, %d extents in %d blocks, "
+	   "free space in %d extents\n", when, fi->files, fi->fragmented,
+	   fi->extents, fi->blocks, fi->freeextents);
+}
+
+int main (int argc, char *argv[]) {
+    FSFragInfo fi;
+    char *path = argc > 2 ? argv[2] : "/";
+    int moved;
+    if (argc < 2) {
+	printf("usage: %s image [path]\n", argv[0]);
+	return 1;
+    }
+    if (open_fs(argv[1])) {
+	fs_perror("open_fs");
+	return 1;
+    }
+    if (fs_fraginfo(path, &fi)) {
+	fs_perror("fs_fraginfo");
+	close_fs();
+	return 1;
+    }
+    report("before", &fi);
+    moved = fs_defrag(path);
+    if (moved < 0) {
+	fs_perror("fs_defrag");
+	close_fs();
+	return 1;
+    }
+    printf("%d files moved\n", moved);
+    if (!fs_fraginfo(path, &fi))
+	report("after", &fi);
+    close_fs();
+    return 0;
+}
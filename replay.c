@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "apfs.h"
+
+static FSFile *handles[65536];
+static char buf[1 << 20];
+static char path[65536], path2[65536];
+
+/* latencies of the replayed calls, in microseconds, per operation */
+static double *samples[FSOP_COUNT];
+static int nsamples[FSOP_COUNT], maxsamples[FSOP_COUNT], errors[FSOP_COUNT];
+static long long bytes[FSOP_COUNT];
+
+static double now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sample (int op, double t, int result) {
+    if (nsamples[op] == maxsamples[op]) {
+	maxsamples[op] = maxsamples[op] ? maxsamples[op] * 2 : 1024;
+	samples[op] = realloc(samples[op], maxsamples[op] * sizeof(double));
+	if (!samples[op]) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    samples[op][nsamples[op]++] = (now() - t) * 1e6;
+    if (result < 0)
+	errors[op]++;
+    else
+	bytes[op] += result;
+}
+
+/* reads or writes count bytes, at most sizeof(buf) at a time */
+static int transfer (FSFile *f, int count, int write) {
+    int done = 0, rc, n;
+    while (done < count) {
+	n = count - done < sizeof(buf) ? count - done : sizeof(buf);
+	rc = write ? fs_write(f, buf, n) : fs_read(f, buf, n);
+	if (rc <= 0)
+	    return rc < 0 ? -1 : done;
+	done += rc;
+    }
+    return done;
+}
+
+static int walk_nothing (char *path, FSDirEntryOut *entry, void *arg) {
+    return FS_WALK_CONTINUE;
+}
+
+/* Issues the call of a record again. Host files of fs_import_fd and
+   fs_export_fd aren't in the trace, so they are replaced by writing and
+   reading the same amount of data, and search handles neither, so a
+   directory search is replayed as a whole, at its fs_findfirst. */
+static int replay (FSTraceRecord *r) {
+    FSFile *f = handles[r->handle];
+    FSDirSearchInfo dsinfo;
+    int rc;
+    if (r->handle && r->op != FSOP_OPEN && !f)
+	return -1;
+    switch (r->op) {
+	case FSOP_OPEN:
+	    f = fs_open(path, r->count);
+	    handles[r->handle] = f;
+	    return f ? 0 : -1;
+	case FSOP_CLOSE:
+	    handles[r->handle] = NULL;
+	    return fs_close(f);
+	case FSOP_READ:
+	    fs_seek(f, r->offset);
+	    return transfer(f, r->count, 0);
+	case FSOP_WRITE:
+	    fs_seek(f, r->offset);
+	    return transfer(f, r->count, 1);
+	case FSOP_TRUNCATE:
+	    fs_seek(f, r->offset);
+	    return fs_truncate(f);
+	case FSOP_MKDIR:
+	    return fs_mkdir(path);
+	case FSOP_RMDIR:
+	    return fs_rmdir(path);
+	case FSOP_DELTREE:
+	    return fs_deltree(path);
+	case FSOP_FINDFIRST:
+	    if (!fs_findfirst(path, &dsinfo))
+		return fs_errno ? -1 : 0;
+	    while (fs_findnext(&dsinfo))
+		;
+	    fs_findend(&dsinfo);
+	    return fs_errno ? -1 : 0;
+	case FSOP_REMOVE:
+	    if (!f)
+		return fs_remove(path);
+	    handles[r->handle] = NULL;
+	    fs_removef(f);
+	    return fs_errno ? -1 : 0;
+	case FSOP_MOVE:
+	    return f ? fs_movef(f, path2) : fs_move(path, path2);
+	case FSOP_RENAME:
+	    return f ? fs_renamef(f, path2) : fs_rename(path, path2);
+	case FSOP_COPY:
+	    return fs_copy(path, path2);
+	case FSOP_IMPORT:
+	case FSOP_EXPORT:
+	    f = fs_open(path, r->op == FSOP_IMPORT);
+	    if (!f)
+		return -1;
+	    rc = transfer(f, r->result > 0 ? r->result : 0, r->op == FSOP_IMPORT);
+	    if (r->op == FSOP_IMPORT && rc >= 0)
+		fs_truncate(f);
+	    fs_close(f);
+	    return rc;
+	case FSOP_DEFRAG:
+	    return fs_defrag(path);
+	case FSOP_COMPACTDIR:
+	    return fs_compactdir(path);
+	case FSOP_FLUSH:
+	    fs_flush();
+	    return fs_errno ? -1 : 0;
+	case FSOP_FSYNC:
+	    return fs_fsync(f);
+	case FSOP_WALK:
+	    return fs_walk(path, walk_nothing, NULL, 0) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+static int cmp_double (const void *a, const void *b) {
+    double x = *(double*)a, y = *(double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile (int op, double p) {
+    int i = p * nsamples[op];
+    return samples[op][i < nsamples[op] ? i : nsamples[op] - 1];
+}
+
+static void report (int csv, double total) {
+    int op, n = 0, calls = 0;
+    for (op = 0; op < FSOP_COUNT; op++)
+	calls += nsamples[op];
+    if (csv)
+	printf("op,calls,errors,mb_per_sec,p50_us,p99_us,p999_us,max_us\n");
+    else
+	printf("{\"seconds\": %.6f, \"calls\": %d, \"calls_per_sec\": %.1f, \"ops\": [",
+	       total, calls, calls / total);
+    for (op = 0; op < FSOP_COUNT; op++) {
+	if (!nsamples[op])
+	    continue;
+	qsort(samples[op], nsamples[op], sizeof(double), cmp_double);
+	if (csv)
+	    printf("%s,%d,%d,%.2f,", fs_opname(op), nsamples[op], errors[op],
+		   bytes[op] / total / 1048576);
+	else
+	    printf("%s\n  {\"op\": \"%s\", \"calls\": %d, \"errors\": %d, "
+		   "\"mb_per_sec\": %.2f, ", n++ ? "," : "", fs_opname(op),
+		   nsamples[op], errors[op], bytes[op] / total / 1048576);
+	printf(csv ? "%.2f,%.2f,%.2f,%.2f\n" :
+	       "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}",
+	       percentile(op, 0.5), percentile(op, 0.99), percentile(op, 0.999),
+	       percentile(op, 1));
+    }
+    if (!csv)
+	printf("\n]}\n");
+}
+
+int main (int argc, char *argv[]) {
+    FSTraceRecord r;
+    FILE *trace;
+    char magic[8];
+    double start, t;
+    int c, csv = 0, paced = 0, blocksize = 0, blocks = 0;
+    while ((c = getopt(argc, argv, "c:f:p")) != -1)
+	switch (c) {
+	    case 'c':
+		if (sscanf(optarg, "%d,%d", &blocksize, &blocks) != 2)
+		    blocksize = 0;
+		break;
+	    case 'f':
+		csv = !strcmp(optarg, "csv");
+		break;
+	    case 'p':
+		paced = 1;
+		break;
+	    default:
+		blocksize = -1;
+	}
+    if (argc - optind != 2 || blocksize < 0) {
+	fprintf(stderr, "usage: %s [-p] [-f json|csv] [-c blocksize,blocks] trace image\n", argv[0]);
+	return 1;
+    }
+    trace = fopen(argv[optind], "rb");
+    if (!trace) {
+	perror(argv[optind]);
+	return 1;
+    }
+    if (fread(magic, 8, 1, trace) != 1 || memcmp(magic, FS_TRACE_MAGIC, 8)) {
+	fprintf(stderr, "%s: not an apfs trace\n", argv[optind]);
+	return 1;
+    }
+    if (blocksize ? create_fsex(argv[optind + 1], blocksize, blocks) : open_fs(argv[optind + 1])) {
+	fs_perror(argv[optind + 1]);
+	return 1;
+    }
+    start = now();
+    while (fread(&r, sizeof(r), 1, trace) == 1) {
+	if (fread(path, 1, r.pathlen, trace) != r.pathlen ||
+	    fread(path2, 1, r.path2len, trace) != r.path2len || r.op >= FSOP_COUNT)
+	    break;
+	path[r.pathlen] = path2[r.path2len] = 0;
+	if (r.op == FSOP_FINDNEXT)
+	    continue;
+	if (paced && (t = r.start / 1e9 - (now() - start)) > 0)
+	    usleep(t * 1e6);
+	t = now();
+	sample(r.op, t, replay(&r));
+    }
+    report(csv, now() - start);
+    close_fs();
+    fclose(trace);
+    return 0;
+}
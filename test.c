@@ -59,9 +59,11 @@ void cmd_create (char *args) {
 }
 
 void cmd_open (char *args) {
+    char *name;
     if (fsopen)
 	close_fs();
-    if (open_fs(args))
+    name = strsep(&args, " \t");
+    if (args ? open_fsex(name, atol(args) * 1024L) : open_fs(name))
 	fs_perror("fs_open");
     else
 	fsopen = 1;
@@ -89,6 +91,62 @@ void cmd_info (char *args) {
 	    (float)inf->totalblocks, (float)inf->freeblocks / (float)convert);
 }
 
+void cmd_stats (char *args) {
+    FSStats st;
+    check_fs_open();
+    if (args && !strcmp(args, "reset")) {
+	fs_resetstats();
+	return;
+    }
+    fs_stats(&st);
+    printf("Blocks read: %lu (%llu bytes), written: %lu (%llu bytes).\n",
+	    st.reads, st.bytesread, st.writes, st.byteswritten);
+    printf("Journal: %lu commits of %lu blocks, %lu reads served.\n",
+	    st.commits, st.commitblocks, st.journalhits);
+    printf("FAT cache: %lu hits, %lu misses, %lu writebacks.\n",
+	    st.fathits, st.fatmisses, st.fatwritebacks);
+    printf("Lookups: %lu, %.2f directory blocks each.\n", st.lookups,
+	    st.lookups ? (float)st.lookupblocks / st.lookups : 0.0);
+    printf("Seeks: %lu, %.2f chain hops each.\n", st.seeks,
+	    st.seeks ? (float)st.seekhops / st.seeks : 0.0);
+    printf("Allocations: %lu, %lu blocks.\n", st.allocs, st.allocblocks);
+    printf("Readahead: %lu blocks.\n", st.readahead);
+    printf("Preload: %lu blocks, %lu reads served.\n", st.preloaded, st.preloadhits);
+}
+
+void cmd_latency (char *args) {
+    FSHistogram *h;
+    int op;
+    if (!fs_latency(0)) {
+	printf("Latency recording is off, see APFS_TRACE in apfs_config.h.\n");
+	return;
+    }
+    if (args && !strcmp(args, "reset")) {
+	fs_resetlatency();
+	return;
+    }
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", "operation", "count",
+	    "mean us", "p50 us", "p99 us", "p999 us", "max us");
+    for (op = 0; op < FSOP_COUNT; op++) {
+	h = fs_latency(op);
+	if (!h->count)
+	    continue;
+	printf("%-12s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		fs_opname(op), h->count, h->total / 1000.0 / h->count,
+		fs_percentile(h, 0.5) / 1000.0, fs_percentile(h, 0.99) / 1000.0,
+		fs_percentile(h, 0.999) / 1000.0, h->max / 1000.0);
+    }
+}
+
+void cmd_record (char *args) {
+    if (!args) {
+	printf("No trace filename specified.\n");
+	return;
+    }
+    if (fs_record(strcmp(args, "off") ? args : NULL))
+	fs_perror("fs_record");
+}
+
 void cmd_mkdir (char *args) {
     check_fs_open();
     if (fs_mkdir(args))
@@ -101,6 +159,12 @@ void cmd_rmdir (char *args) {
 	fs_perror("fs_rmdir");
 }
 
+void cmd_deltree (char *args) {
+    check_fs_open();
+    if (fs_deltree(args))
+	fs_perror("fs_deltree");
+}
+
 void cmd_ls (char *args) {
     FSDirSearchInfo dsinfo;
     FSFileInfo *fi;
@@ -119,11 +183,36 @@ void cmd_ls (char *args) {
     }
 }
 
+typedef struct {
+    long files, dirs;
+    long long bytes;
+} DuTotals;
+
+/* called from the fs_walk workers, hence the atomic adds */
+int du_visit (char *path, FSDirEntryOut *e, void *arg) {
+    DuTotals *t = (DuTotals*)arg;
+    if (e->attrs & FATTR_DIRECTORY)
+	__sync_fetch_and_add(&t->dirs, 1);
+    else {
+	__sync_fetch_and_add(&t->files, 1);
+	__sync_fetch_and_add(&t->bytes, e->size);
+    }
+    return FS_WALK_CONTINUE;
+}
+
+void cmd_du (char *args) {
+    DuTotals t = {0, 0, 0};
+    check_fs_open();
+    if (fs_walk(args && *args ? args : "/", du_visit, &t, 0) < 0) {
+	fs_perror("fs_walk");
+	return;
+    }
+    printf("%ld files, %ld directories, %lld bytes.\n", t.files, t.dirs, t.bytes);
+}
+
 void cmd_copyin (char *args) {
     char *name = strsep(&args, " \t");
-    FSFile *f;
-    int rc, fd;
-    char buf[4096];
+    int fd;
     check_fs_open();
     if (!args) {
 	printf("No target filename specified.\n");
@@ -134,56 +223,195 @@ void cmd_copyin (char *args) {
 	perror("open");
 	return;
     }
-    f = fs_open(args, 1);
-    if (!f) {
-	fs_perror("fs_open");
-	return;
-    }
-    while ((rc = read(fd, buf, sizeof(buf))))
-	if (fs_write(f, buf, rc) != rc) {
-	    fs_perror("fs_write");
-	    return;
-	}
-    fs_truncate(f);
+    if (fs_import_fd(fd, args) < 0)
+	fs_perror("fs_import_fd");
     close(fd);
-    fs_close(f);
 }
 
 void cmd_copyout (char *args) {
     char *name = strsep(&args, " \t");
-    FSFile *f;
-    int rc, fd;
-    char buf[4096];
+    int fd;
     check_fs_open();
     if (!args) {
 	printf("No target filename specified.\n");
 	return;
     }
-    f = fs_open(name, 0);
-    if (!f) {
-	fs_perror("fs_open");
-	return;
-    }
     fd = open(args, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd < 0) {
 	perror("open");
 	return;
     }
-    while ((rc = fs_read(f, buf, sizeof(buf))))
-	if (write(fd, buf, rc) != rc) {
-	    perror("write");
-	    return;
-	}
-    fs_close(f);
+    if (fs_export_fd(name, fd) < 0)
+	fs_perror("fs_export_fd");
     close(fd);
 }
 
+void cmd_copy (char *args) {
+    char *name = strsep(&args, " \t");
+    check_fs_open();
+    if (!args) {
+	printf("No target filename specified.\n");
+	return;
+    }
+    if (fs_copy(name, args) < 0)
+	fs_perror("fs_copy");
+}
+
 void cmd_del (char *args) {
     check_fs_open();
     if (fs_remove(args))
 	fs_perror("fs_remove");
 }
 
+void cmd_move (char *args) {
+    char *name = strsep(&args, " \t");
+    check_fs_open();
+    if (!args) {
+	printf("No target filename specified.\n");
+	return;
+    }
+    if (fs_move(name, args))
+	fs_perror("fs_move");
+}
+
+/* The self checks work on a scratch file, which they write and read
+   back through the library, and remove when they're done */
+#define CHECK_FILE "/.check"
+
+/* Writes size bytes of c at the position of f */
+int check_fill (FSFile *f, char c, int size) {
+    char buf[4096];
+    int n;
+    memset(buf, c, sizeof(buf));
+    for (; size > 0; size -= n) {
+	n = size < sizeof(buf) ? size : sizeof(buf);
+	if (fs_write(f, buf, n) != n)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Tells whether the file of f holds exactly size bytes of c */
+int check_contents (FSFile *f, char c, int size) {
+    char buf[4096];
+    int n, i, total = 0;
+    fs_seek(f, 0);
+    while ((n = fs_read(f, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < n; i++)
+	    if (buf[i] != c)
+		return 0;
+	total += n;
+    }
+    return n == 0 && total == size && fs_getfilesize(f) == size;
+}
+
+/* Cutting a file to nothing and writing it again replaces its data, as
+   seen by a handle opened while it's being written, and after it's opened
+   again */
+int check_truncate_write () {
+    FSFile *f, *g;
+    int ok;
+    f = fs_open(CHECK_FILE, 1);
+    if (!f)
+	return 0;
+    ok = check_fill(f, 'A', 30572);
+    fs_close(f);
+    f = fs_open(CHECK_FILE, 1);
+    if (!f)
+	return 0;
+    ok = ok && !fs_truncate(f) && check_fill(f, 'B', 217);
+    g = fs_open(CHECK_FILE, 0);
+    if (!g) {
+	fs_close(f);
+	return 0;
+    }
+    ok = ok && check_contents(g, 'B', 217);
+    fs_close(g);
+    fs_close(f);
+    f = fs_open(CHECK_FILE, 0);
+    ok = ok && f && check_contents(f, 'B', 217);
+    if (f)
+	fs_close(f);
+    return ok;
+}
+
+/* Cutting a file at a block boundary and writing there puts the data
+   right at the cut */
+int check_truncate_aligned () {
+    FSFile *f;
+    char buf[4096];
+    int bs = fs_info()->blocksize, cut, n, i, j, ok = 1;
+    for (cut = 0; ok && cut <= 2 * bs; cut += bs) {
+	f = fs_open(CHECK_FILE, 1);
+	if (!f)
+	    return 0;
+	ok = check_fill(f, 'A', 4 * bs) && fs_seek(f, cut) == cut &&
+	     !fs_truncate(f) && check_fill(f, 'B', 100);
+	fs_close(f);
+	f = fs_open(CHECK_FILE, 0);
+	if (!f)
+	    return 0;
+	ok = ok && fs_getfilesize(f) == cut + 100;
+	for (i = 0; ok && (n = fs_read(f, buf, sizeof(buf))) > 0; i += n)
+	    for (j = 0; ok && j < n; j++)
+		ok = buf[j] == (i + j < cut ? 'A' : 'B');
+	fs_close(f);
+	fs_remove(CHECK_FILE);
+    }
+    return ok;
+}
+
+#if USE_FUNOPEN || USE_FOPENCOOKIE
+/* Opening an existing file for writing with fs_fopen overwrites it */
+int check_fopen_overwrite () {
+    FSFile *f;
+    FILE *stream;
+    char buf[16];
+    int ok;
+    f = fs_open(CHECK_FILE, 1);
+    if (!f)
+	return 0;
+    ok = check_fill(f, 'A', 30572);
+    fs_close(f);
+    stream = fs_fopen(CHECK_FILE, "w");
+    if (!stream)
+	return 0;
+    ok = fputs("hello", stream) >= 0 && ok;
+    ok = !fclose(stream) && ok;
+    stream = fs_fopen(CHECK_FILE, "r");
+    if (!stream)
+	return 0;
+    ok = ok && fgets(buf, sizeof(buf), stream) && !strcmp(buf, "hello") &&
+	 fgetc(stream) == EOF;
+    fclose(stream);
+    return ok;
+}
+#endif /* USE_FUNOPEN || USE_FOPENCOOKIE */
+
+struct {
+    char *name;
+    int (*run)(void);
+} checks[] = {
+    {"truncate to 0, then write", check_truncate_write},
+    {"truncate at block boundaries", check_truncate_aligned},
+#if USE_FUNOPEN || USE_FOPENCOOKIE
+    {"overwrite with fs_fopen", check_fopen_overwrite},
+#endif
+    {NULL, NULL}
+};
+
+void cmd_check (char *args) {
+    int i, ok;
+    check_fs_open();
+    for (i = 0; checks[i].name; i++) {
+	ok = checks[i].run();
+	printf("%-40s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+	if (!ok && fs_errno)
+	    fs_perror(checks[i].name);
+	fs_remove(CHECK_FILE);
+    }
+}
+
 #define elif else if
 
 extern void showhelp(char*);
@@ -207,18 +435,34 @@ void process_command (char *line) {
 	cmd_close(args);
     elif (!strcmp(cmd, "info"))
 	cmd_info(args);
+    elif (!strcmp(cmd, "stats"))
+	cmd_stats(args);
+    elif (!strcmp(cmd, "latency"))
+	cmd_latency(args);
+    elif (!strcmp(cmd, "du"))
+	cmd_du(args);
+    elif (!strcmp(cmd, "record"))
+	cmd_record(args);
     elif (!strcmp(cmd, "mkdir"))
 	cmd_mkdir(args);
     elif (!strcmp(cmd, "rmdir"))
 	cmd_rmdir(args);
+    elif (!strcmp(cmd, "deltree"))
+	cmd_deltree(args);
     elif (!strcmp(cmd, "ls"))
 	cmd_ls(args);
     elif (!strcmp(cmd, "copyin"))
 	cmd_copyin(args);
     elif (!strcmp(cmd, "copyout"))
 	cmd_copyout(args);
+    elif (!strcmp(cmd, "copy"))
+	cmd_copy(args);
     elif (!strcmp(cmd, "del"))
 	cmd_del(args);
+    elif (!strcmp(cmd, "move"))
+	cmd_move(args);
+    elif (!strcmp(cmd, "check"))
+	cmd_check(args);
     else
 	printf("Invalid command name \"%s\".\nFor more information, type \"help\".\n", cmd);
 }
@@ -1,12 +1,38 @@
 #include <stdio.h>
+#include <sys/stat.h>
 #include "apfs.h"
 
-int main () {
-    FSDirSearchInfo dsinfo;
-    FSFileInfo *fi;
+/* fs_walk runs it in this thread, as it's given a single one, so it may
+   read the files it visits */
+static int extract (char *path, FSDirEntryOut *fi, void *arg) {
     FILE *f1, *f2;
     int rc;
     char buf[1024];
+    path++;	/* relative to the current directory */
+    if ((fi->attrs & FATTR_DIRECTORY) == FATTR_DIRECTORY) {
+	mkdir(path, 0777);
+	return FS_WALK_CONTINUE;
+    }
+    f1 = fs_fopen(path, "r");
+    if (!f1) {
+	fs_perror(path);
+	return FS_WALK_CONTINUE;
+    }
+    f2 = fopen(path, "w+");
+    if (!f2) {
+	perror(path);
+	fclose(f1);
+	return FS_WALK_CONTINUE;
+    }
+    while ((rc = fread(buf, 1, sizeof(buf), f1)) > 0)
+	fwrite(buf, rc, 1, f2);
+    fclose(f1);
+    fclose(f2);
+    printf("%s\n", path);
+    return FS_WALK_CONTINUE;
+}
+
+int main () {
     printf("Reading archive... ");
     fflush(stdout);
     open_fs("apfs.28Mar2002.fs");
@@ -16,22 +42,8 @@ int main () {
     }
     printf("OK\n");
     printf("Extracting files...\n");
-    for (fi = fs_findfirst("/", &dsinfo); fi; fi = fs_findnext(&dsinfo)) {
-	if ((fi->attrs & FATTR_DIRECTORY) != FATTR_DIRECTORY) {
-	    f1 = fs_fopen(fi->fname, "r");
-	    f2 = fopen(fi->fname, "w+");
-	    while (!feof(f1)) {
-		rc = fread(buf, 1, sizeof(buf), f1);
-		fwrite(buf, rc, 1, f2);
-	    }
-	    fclose(f1);
-	    fclose(f2);
-	    printf("%s\n", fi->fname);
-	}
-    }
-    if (fs_errno) {
-	fs_perror("fs_findfirst");
-	fs_findend(&dsinfo);
+    if (fs_walk("/", extract, NULL, 1) < 0) {
+	fs_perror("fs_walk");
 	return 1;
     }
     return 1;